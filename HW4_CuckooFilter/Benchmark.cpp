@@ -0,0 +1,507 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "CuckooFilter.h"
+
+// Benchmark of the cuckoo filters. Build it next to CuckooFilter.cpp, e.g.
+// g++ -O2 -std=c++17 -pthread Benchmark.cpp -o Benchmark
+// Usage: Benchmark [number of items] [seed]
+
+using Clock = std::chrono::steady_clock;
+
+// Share of the filter capacity after which every measurement is taken.
+const double LOAD_FACTORS[] = { 0.25, 0.5, 0.75, 0.9, 0.95 };
+// Latency is measured on every LATENCY_SAMPLE_EVERY-th operation, so the timer barely affects the throughput.
+constexpr size_t LATENCY_SAMPLE_EVERY{ 16 };
+// Number of lookups of present and of absent elements at every load factor.
+constexpr size_t NUM_OF_LOOKUPS{ 1 << 18 };
+// Numbers of threads ConcurrentCuckooFilter is measured with.
+const size_t THREAD_COUNTS[] = { 1, 2, 4, 8 };
+
+/// <summary>
+/// Plain Bloom filter with the optimal number of hash functions for its size, the baseline for the cuckoo filters.
+/// </summary>
+class BloomFilter {
+public:
+	BloomFilter(size_t num_of_elements, double bits_per_element)
+		: num_of_bits_(std::max<size_t>(64, static_cast<size_t>(num_of_elements * bits_per_element))),
+		num_of_hashes_(std::max<size_t>(1, static_cast<size_t>(std::round(bits_per_element * std::log(2.0))))),
+		bits_((num_of_bits_ + 63) / 64) {}
+
+	bool Insert(std::string_view elem) {
+		uint64_t hash = Hash64(elem);
+		for (size_t i = 0; i < num_of_hashes_; ++i) {
+			size_t bit = GetBit(hash, i);
+			bits_[bit / 64] |= uint64_t{ 1 } << (bit % 64);
+		}
+		return true;
+	}
+
+	bool Lookup(std::string_view elem) const {
+		uint64_t hash = Hash64(elem);
+		for (size_t i = 0; i < num_of_hashes_; ++i) {
+			size_t bit = GetBit(hash, i);
+			if ((bits_[bit / 64] & (uint64_t{ 1 } << (bit % 64))) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t GetSizeInBytes() const {
+		return bits_.size() * sizeof(uint64_t);
+	}
+
+private:
+	size_t num_of_bits_;
+	size_t num_of_hashes_;
+	std::vector<uint64_t> bits_;
+
+	// Double hashing: the i-th function is h1 + i * h2.
+	size_t GetBit(uint64_t hash, size_t i) const {
+		uint64_t h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+		return static_cast<size_t>((h1 + i * h2) % num_of_bits_);
+	}
+};
+
+/// <summary>
+/// Exact set of the elements, the baseline without false positives.
+/// </summary>
+class HashSetFilter {
+public:
+	explicit HashSetFilter(size_t num_of_elements) {
+		set_.reserve(num_of_elements);
+	}
+
+	bool Insert(std::string_view elem) {
+		set_.emplace(elem);
+		return true;
+	}
+
+	bool Lookup(std::string_view elem) const {
+		return set_.count(std::string(elem)) != 0;
+	}
+
+	// Estimate: bucket array, nodes and the heap memory of long strings.
+	size_t GetSizeInBytes() const {
+		size_t size = set_.bucket_count() * sizeof(void*);
+		for (const auto& elem : set_) {
+			size += sizeof(void*) + sizeof(size_t) + sizeof(std::string);
+			if (elem.capacity() >= sizeof(std::string)) {
+				size += elem.capacity() + 1;
+			}
+		}
+		return size;
+	}
+
+private:
+	std::unordered_set<std::string> set_;
+};
+
+/// <summary>
+/// Synthetic elements: members are inserted, absent elements never are, so every lookup of an absent element
+/// that answers true is a false positive.
+/// </summary>
+struct Keys {
+	std::vector<std::string> members;
+	std::vector<std::string> absent;
+};
+
+Keys GenerateKeys(size_t num_of_members, uint64_t seed) {
+	std::mt19937_64 random(seed);
+	Keys keys;
+	keys.members.reserve(num_of_members);
+	for (size_t i = 0; i < num_of_members; ++i) {
+		keys.members.push_back("user" + std::to_string(random() % 1000000) + " video" + std::to_string(i));
+	}
+	keys.absent.reserve(NUM_OF_LOOKUPS);
+	for (size_t i = 0; i < NUM_OF_LOOKUPS; ++i) {
+		keys.absent.push_back("user" + std::to_string(random() % 1000000) + " absent" + std::to_string(i));
+	}
+	return keys;
+}
+
+/// <summary>
+/// Latency samples in nanoseconds.
+/// </summary>
+class Latencies {
+public:
+	void Add(Clock::duration duration) {
+		samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	}
+
+	// Value below which the given share of the samples is.
+	long long GetPercentile(double share) {
+		if (samples_.empty()) {
+			return 0;
+		}
+		size_t index = std::min(samples_.size() - 1, static_cast<size_t>(share * samples_.size()));
+		std::nth_element(samples_.begin(), samples_.begin() + index, samples_.end());
+		return samples_[index];
+	}
+
+	void Clear() {
+		samples_.clear();
+	}
+
+private:
+	std::vector<long long> samples_;
+};
+
+double GetSeconds(Clock::duration duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+// Millions of operations per second.
+double GetThroughput(size_t num_of_operations, Clock::duration duration) {
+	return num_of_operations / GetSeconds(duration) / 1e6;
+}
+
+void PrintHeader() {
+	std::printf("%-22s %5s %9s %8s %6s %6s %7s %8s %8s %8s %8s %6s %9s %6s %7s\n", "filter", "load", "items",
+		"ins Mops", "p50ns", "p99ns", "p99.9ns", "hit Mops", "miss Mops", "bat hit", "bat miss", "lk p99", "fpr", "bits",
+		"failed");
+}
+
+// Whether the filter answers arrays of elements with LookupBatch.
+template <typename Filter, typename = void>
+struct HasLookupBatch : std::false_type {};
+
+template <typename Filter>
+struct HasLookupBatch<Filter, std::void_t<decltype(std::declval<const Filter&>().LookupBatch(
+	static_cast<const std::string*>(nullptr), size_t{ 0 }, static_cast<bool*>(nullptr)))>> : std::true_type {};
+
+/// <summary>
+/// Throughput of LookupBatch on the first inserted members and on the absent elements, or zeros for filters
+/// without it. Adds the members it does not find to false_negatives.
+/// </summary>
+template <typename Filter>
+std::pair<double, double> MeasureBatchLookups(const Filter& filter, const Keys& keys, const std::vector<bool>& inserted,
+	size_t num_of_items, size_t& false_negatives) {
+	if constexpr (HasLookupBatch<Filter>::value) {
+		size_t num_of_hits = std::min(num_of_items, NUM_OF_LOOKUPS);
+		std::unique_ptr<bool[]> results(new bool[std::max(num_of_hits, keys.absent.size())]);
+		Clock::time_point begin = Clock::now();
+		filter.LookupBatch(keys.members.data(), num_of_hits, results.get());
+		Clock::duration hit_time = Clock::now() - begin;
+		for (size_t i = 0; i < num_of_hits; ++i) {
+			false_negatives += !results[i] && inserted[i] ? 1 : 0;
+		}
+		begin = Clock::now();
+		filter.LookupBatch(keys.absent.data(), keys.absent.size(), results.get());
+		Clock::duration miss_time = Clock::now() - begin;
+		return { GetThroughput(num_of_hits, hit_time), GetThroughput(keys.absent.size(), miss_time) };
+	}
+	else {
+		return { 0.0, 0.0 };
+	}
+}
+
+/// <summary>
+/// Fills the filter with members up to every load factor of capacity and measures inserts and lookups.
+/// Returns the number of false negatives (must be 0).
+/// </summary>
+template <typename Filter>
+size_t RunLoadSweep(const std::string& name, Filter& filter, size_t capacity, const Keys& keys) {
+	std::vector<bool> inserted(keys.members.size(), false);
+	size_t num_of_items = 0, num_of_failed = 0, num_of_false_negatives = 0;
+	Latencies insert_latencies, lookup_latencies;
+	for (double load : LOAD_FACTORS) {
+		size_t target = std::min(keys.members.size(), static_cast<size_t>(load * capacity));
+		if (target <= num_of_items) {
+			continue;
+		}
+		insert_latencies.Clear();
+		size_t first = num_of_items;
+		Clock::time_point begin = Clock::now();
+		for (; num_of_items < target; ++num_of_items) {
+			bool sampled = num_of_items % LATENCY_SAMPLE_EVERY == 0;
+			Clock::time_point start = sampled ? Clock::now() : begin;
+			inserted[num_of_items] = filter.Insert(keys.members[num_of_items]);
+			if (sampled) {
+				insert_latencies.Add(Clock::now() - start);
+			}
+			num_of_failed += inserted[num_of_items] ? 0 : 1;
+		}
+		Clock::duration insert_time = Clock::now() - begin;
+
+		// Lookups of members spread evenly over the inserted ones; in order, so that reading the keys themselves
+		// does not miss the cache.
+		std::vector<size_t> hits(NUM_OF_LOOKUPS);
+		for (size_t i = 0; i < hits.size(); ++i) {
+			hits[i] = static_cast<size_t>(static_cast<double>(i) * num_of_items / hits.size());
+		}
+		lookup_latencies.Clear();
+		begin = Clock::now();
+		for (size_t i = 0; i < hits.size(); ++i) {
+			bool sampled = i % LATENCY_SAMPLE_EVERY == 0;
+			Clock::time_point start = sampled ? Clock::now() : begin;
+			bool found = filter.Lookup(keys.members[hits[i]]);
+			if (sampled) {
+				lookup_latencies.Add(Clock::now() - start);
+			}
+			num_of_false_negatives += !found && inserted[hits[i]] ? 1 : 0;
+		}
+		Clock::duration hit_time = Clock::now() - begin;
+
+		size_t num_of_false_positives = 0;
+		begin = Clock::now();
+		for (const std::string& elem : keys.absent) {
+			num_of_false_positives += filter.Lookup(elem) ? 1 : 0;
+		}
+		Clock::duration miss_time = Clock::now() - begin;
+		std::pair<double, double> batch_throughput = MeasureBatchLookups(filter, keys, inserted, num_of_items,
+			num_of_false_negatives);
+
+		std::printf("%-22s %5.2f %9zu %8.2f %6lld %6lld %7lld %8.2f %8.2f %8.2f %8.2f %6lld %9.6f %6.2f %7zu\n",
+			name.c_str(), static_cast<double>(num_of_items) / capacity, num_of_items,
+			GetThroughput(num_of_items - first, insert_time), insert_latencies.GetPercentile(0.5),
+			insert_latencies.GetPercentile(0.99), insert_latencies.GetPercentile(0.999),
+			GetThroughput(hits.size(), hit_time), GetThroughput(keys.absent.size(), miss_time),
+			batch_throughput.first, batch_throughput.second, lookup_latencies.GetPercentile(0.99),
+			static_cast<double>(num_of_false_positives) / keys.absent.size(),
+			8.0 * filter.GetSizeInBytes() / num_of_items, num_of_failed);
+	}
+	return num_of_false_negatives;
+}
+
+template <size_t FingerprintBits, size_t BucketSize, bool SemiSorted = false>
+size_t RunCuckoo(const Keys& keys) {
+	using Filter = CuckooFilter<FingerprintBits, BucketSize, SemiSorted>;
+	// The largest filter the members can fill: a power of 2 buckets holding at most all the members.
+	size_t num_of_buckets = NextPowerOf2(keys.members.size() / BucketSize + 1) / 2;
+	Filter filter(static_cast<size_t>((num_of_buckets - 1) * BucketSize / (1 + Filter::FAILURE_PROB)));
+	std::string name = "cuckoo " + std::to_string(FingerprintBits) + "x" + std::to_string(BucketSize)
+		+ (SemiSorted ? " semi" : "");
+	return RunLoadSweep(name, filter, filter.GetCapacity(), keys);
+}
+
+// The concurrent filter driven from one thread, to show what its lock stripes and version checks cost.
+size_t RunConcurrentCuckoo(const Keys& keys) {
+	using Filter = ConcurrentCuckooFilter<>;
+	size_t num_of_buckets = NextPowerOf2(keys.members.size() / CUCKOO_BUCKET_SIZE + 1) / 2;
+	Filter filter(static_cast<size_t>((num_of_buckets - 1) * CUCKOO_BUCKET_SIZE / (1 + Filter::FAILURE_PROB)));
+	return RunLoadSweep("cuckoo concurrent", filter, filter.GetCapacity(), keys);
+}
+
+size_t RunBloom(const Keys& keys, double bits_per_element) {
+	BloomFilter filter(keys.members.size(), bits_per_element);
+	return RunLoadSweep("bloom " + std::to_string(static_cast<int>(bits_per_element)) + " bits",
+		filter, keys.members.size(), keys);
+}
+
+size_t RunHashSet(const Keys& keys) {
+	HashSetFilter filter(keys.members.size());
+	return RunLoadSweep("unordered_set", filter, keys.members.size(), keys);
+}
+
+/// <summary>
+/// Runs body(thread index) on the given number of threads and returns the time until all of them finish.
+/// </summary>
+template <typename Body>
+Clock::duration RunOnThreads(size_t num_of_threads, Body body) {
+	std::vector<std::thread> threads;
+	Clock::time_point begin = Clock::now();
+	for (size_t i = 0; i < num_of_threads; ++i) {
+		threads.emplace_back(body, i);
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	return Clock::now() - begin;
+}
+
+// First element of the part-th of num_of_parts equal parts of size elements.
+size_t GetPartBegin(size_t size, size_t part, size_t num_of_parts) {
+	return size * part / num_of_parts;
+}
+
+/// <summary>
+/// Measures ConcurrentCuckooFilter with every number of THREAD_COUNTS. The threads insert the first half of
+/// the members, each its own part; then half of them insert the second half while the others keep looking up
+/// the first half, so lookups race with eviction moves and every inserted member must still be found; at last
+/// all of them look up members and absent elements. Returns the number of false negatives.
+/// </summary>
+size_t RunConcurrentSweep(const Keys& keys) {
+	using Filter = ConcurrentCuckooFilter<>;
+	std::printf("\n%-8s %8s %10s %10s %8s %8s %9s %7s\n", "threads", "ins Mops", "mix ins", "mix lookup",
+		"hit Mops", "miss Mops", "fpr", "failed");
+	const size_t half = keys.members.size() / 2;
+	size_t total_false_negatives = 0;
+	for (size_t num_of_threads : THREAD_COUNTS) {
+		Filter filter(keys.members.size());
+		std::unique_ptr<bool[]> inserted(new bool[keys.members.size()]);
+		std::atomic<size_t> num_of_failed{ 0 }, num_of_false_negatives{ 0 }, num_of_false_positives{ 0 };
+		auto insert_part = [&](size_t first, size_t last) {
+			size_t failed = 0;
+			for (size_t i = first; i < last; ++i) {
+				inserted[i] = filter.Insert(keys.members[i]);
+				failed += inserted[i] ? 0 : 1;
+			}
+			num_of_failed += failed;
+		};
+
+		Clock::duration insert_time = RunOnThreads(num_of_threads, [&](size_t thread) {
+			insert_part(GetPartBegin(half, thread, num_of_threads), GetPartBegin(half, thread + 1, num_of_threads));
+		});
+
+		// Writers and readers at the same time; with one thread, one of each.
+		size_t num_of_writers = std::max<size_t>(1, num_of_threads / 2);
+		size_t num_of_readers = std::max<size_t>(1, num_of_threads - num_of_writers);
+		std::atomic<size_t> writers_left{ num_of_writers }, num_of_mixed_lookups{ 0 };
+		Clock::duration mixed_time = RunOnThreads(num_of_writers + num_of_readers, [&](size_t thread) {
+			if (thread < num_of_writers) {
+				size_t rest = keys.members.size() - half;
+				insert_part(half + GetPartBegin(rest, thread, num_of_writers),
+					half + GetPartBegin(rest, thread + 1, num_of_writers));
+				--writers_left;
+				return;
+			}
+			size_t reader = thread - num_of_writers, lookups = 0, false_negatives = 0;
+			for (size_t i = GetPartBegin(half, reader, num_of_readers); writers_left.load() != 0 && half != 0;
+				i = (i + 1) % half) {
+				false_negatives += inserted[i] && !filter.Lookup(keys.members[i]) ? 1 : 0;
+				++lookups;
+			}
+			num_of_mixed_lookups += lookups;
+			num_of_false_negatives += false_negatives;
+		});
+		size_t num_of_mixed_inserts = keys.members.size() - half;
+
+		Clock::duration hit_time = RunOnThreads(num_of_threads, [&](size_t thread) {
+			size_t false_negatives = 0;
+			for (size_t i = GetPartBegin(NUM_OF_LOOKUPS, thread, num_of_threads);
+				i < GetPartBegin(NUM_OF_LOOKUPS, thread + 1, num_of_threads); ++i) {
+				size_t member = i * keys.members.size() / NUM_OF_LOOKUPS;
+				false_negatives += inserted[member] && !filter.Lookup(keys.members[member]) ? 1 : 0;
+			}
+			num_of_false_negatives += false_negatives;
+		});
+		Clock::duration miss_time = RunOnThreads(num_of_threads, [&](size_t thread) {
+			size_t false_positives = 0;
+			for (size_t i = GetPartBegin(keys.absent.size(), thread, num_of_threads);
+				i < GetPartBegin(keys.absent.size(), thread + 1, num_of_threads); ++i) {
+				false_positives += filter.Lookup(keys.absent[i]) ? 1 : 0;
+			}
+			num_of_false_positives += false_positives;
+		});
+
+		std::printf("%-8zu %8.2f %10.2f %10.2f %8.2f %8.2f %9.6f %7zu\n", num_of_threads,
+			GetThroughput(half, insert_time), GetThroughput(num_of_mixed_inserts, mixed_time),
+			GetThroughput(num_of_mixed_lookups, mixed_time), GetThroughput(NUM_OF_LOOKUPS, hit_time),
+			GetThroughput(keys.absent.size(), miss_time),
+			static_cast<double>(num_of_false_positives) / keys.absent.size(), num_of_failed.load());
+		total_false_negatives += num_of_false_negatives;
+	}
+	return total_false_negatives;
+}
+
+/// <summary>
+/// Replays a synthetic watch log through UserFilterStore and checks the answers against the exact history.
+/// Users are skewed: a few watch a lot, most watch a little. Returns the number of false negatives.
+/// </summary>
+size_t RunUserStream(size_t num_of_events, uint64_t seed) {
+	const size_t num_of_users = std::max<size_t>(1, num_of_events / 16), num_of_videos = 10000;
+	std::mt19937_64 random(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	struct Event {
+		bool watch;
+		uint64_t user;
+		uint64_t video;
+	};
+	std::vector<Event> events(num_of_events);
+	for (Event& event : events) {
+		event.watch = uniform(random) < 0.5;
+		event.user = static_cast<uint64_t>(num_of_users * std::pow(uniform(random), 3));
+		event.video = random() % num_of_videos;
+	}
+	std::vector<std::string> users(num_of_users), videos(num_of_videos);
+	for (size_t i = 0; i < num_of_users; ++i) {
+		users[i] = "user" + std::to_string(i);
+	}
+	for (size_t i = 0; i < num_of_videos; ++i) {
+		videos[i] = "video" + std::to_string(i);
+	}
+
+	UserFilterStore store(num_of_videos);
+	size_t num_of_failed = 0;
+	std::vector<bool> answers;
+	answers.reserve(num_of_events);
+	Clock::time_point begin = Clock::now();
+	for (const Event& event : events) {
+		if (event.watch) {
+			num_of_failed += store.Watch(users[event.user], videos[event.video]) ? 0 : 1;
+		}
+		else {
+			answers.push_back(store.Check(users[event.user], videos[event.video]));
+		}
+	}
+	Clock::duration time = Clock::now() - begin;
+
+	std::unordered_set<uint64_t> history;
+	size_t num_of_checks = 0, num_of_negatives = 0, num_of_false_positives = 0, num_of_false_negatives = 0;
+	for (const Event& event : events) {
+		uint64_t pair = event.user * num_of_videos + event.video;
+		if (event.watch) {
+			history.insert(pair);
+			continue;
+		}
+		bool answer = answers[num_of_checks++];
+		if (history.count(pair) == 0) {
+			++num_of_negatives;
+			num_of_false_positives += answer ? 1 : 0;
+		}
+		else {
+			num_of_false_negatives += answer ? 0 : 1;
+		}
+	}
+	std::printf("\nUserFilterStore: %zu events of %zu users, %.2f Mops, fpr %.6f, %zu failed watches,"
+		" %.2f MB of filters for %zu distinct watches\n", num_of_events, store.GetNumOfUsers(),
+		GetThroughput(num_of_events, time), num_of_negatives == 0 ? 0.0 : static_cast<double>(num_of_false_positives) / num_of_negatives,
+		num_of_failed, store.GetSizeInBytes() / 1e6, history.size());
+	return num_of_false_negatives;
+}
+
+int main(int argc, char* argv[]) {
+	size_t num_of_items = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : size_t{ 1 } << 20;
+	uint64_t seed = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+	if (num_of_items == 0) {
+		std::fprintf(stderr, "Usage: Benchmark [number of items] [seed]\n");
+		return 1;
+	}
+
+	Keys keys = GenerateKeys(num_of_items, seed);
+	PrintHeader();
+	size_t false_negatives = 0;
+	false_negatives += RunCuckoo<8, 4>(keys);
+	false_negatives += RunCuckoo<12, 4>(keys);
+	false_negatives += RunCuckoo<12, 4, true>(keys);
+	false_negatives += RunCuckoo<16, 2>(keys);
+	false_negatives += RunCuckoo<16, 4>(keys);
+	false_negatives += RunCuckoo<16, 8>(keys);
+	false_negatives += RunCuckoo<32, 4>(keys);
+	false_negatives += RunConcurrentCuckoo(keys);
+	false_negatives += RunBloom(keys, 8);
+	false_negatives += RunBloom(keys, 12);
+	false_negatives += RunBloom(keys, 16);
+	false_negatives += RunHashSet(keys);
+	false_negatives += RunConcurrentSweep(keys);
+	false_negatives += RunUserStream(4 * num_of_items, seed);
+
+	if (false_negatives != 0) {
+		std::fprintf(stderr, "%zu false negatives!\n", false_negatives);
+		return 1;
+	}
+	return 0;
+}
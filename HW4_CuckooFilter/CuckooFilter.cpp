@@ -1,261 +1,257 @@
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
-#include <functional>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <random>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "CuckooFilter.h"
 
 //  . -196
 
 /// <summary>
-/// Alias for char. Smallest bit should be 1 for a valid fingerprint.
+/// One line of the input. The pieces point into the input text.
 /// </summary>
-typedef char fingerprint_t;
-
-// Object for randoming.
-std::mt19937 rrand;
+struct Command {
+	std::string_view name;
+	std::string_view user;
+	std::string_view video;
+};
 
-// Returns the next power of 2 of given value (e.g. 5 -> 8).
-size_t NextPowerOf2(size_t n) {
-	n--;
-	n |= n >> 1;
-	n |= n >> 2;
-	n |= n >> 4;
-	n |= n >> 8;
-	n |= n >> 16;
-	n++;
-	return n;
+/// <summary>
+/// Splits a line into three pieces: command, user and video.
+/// </summary>
+void ParseLine(std::string_view line, Command& command) {
+	auto next_word = [&line]() {
+		size_t space = line.find(' ');
+		std::string_view word = line.substr(0, space);
+		line.remove_prefix(space == std::string_view::npos ? line.size() : space + 1);
+		return word;
+	};
+	command.name = next_word();
+	command.user = next_word();
+	command.video = next_word();
 }
 
-// Keeps powers of p = 31 to use in hash.
-class Powers {
-public:
-	static constexpr int MAX_ELEM_LEN{ 15 };
-	uint32_t powers[MAX_ELEM_LEN];
-
-	Powers() {
-		const uint32_t p = 31;
-		powers[0] = 1;
-		for (int i = 1; i < MAX_ELEM_LEN; ++i) {
-			powers[i] = powers[i - 1] * p;
-		}
+/// <summary>
+/// Takes the next line off the text (without the line break).
+/// </summary>
+std::string_view NextLine(std::string_view& text) {
+	size_t end = text.find('\n');
+	std::string_view line = text.substr(0, end);
+	text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+	if (!line.empty() && line.back() == '\r') {
+		line.remove_suffix(1);
 	}
-};
+	return line;
+}
 
-// Holds cuckoo filter information (buckets).
-class CuckooHolder {
+/// <summary>
+/// Parses the input text on its own thread, so parsing overlaps with the filter work. Commands are handed
+/// over in batches through a short queue, in input order.
+/// </summary>
+class CommandReader {
 public:
-	// Size of one bucket in fingerprints.
-	static constexpr size_t BUCKET_SIZE{ 4 };
+	// Number of commands in a batch.
+	static constexpr size_t BATCH_SIZE{ 1 << 12 };
+	// Number of parsed batches that may wait in the queue.
+	static constexpr size_t MAX_QUEUED_BATCHES{ 4 };
 
-	explicit CuckooHolder(size_t num_of_buckets) : num_of_buckets_(num_of_buckets) {
-		data_ = new fingerprint_t[BUCKET_SIZE * num_of_buckets]{};
-	}
+	explicit CommandReader(std::string_view text) : text_(text), thread_(&CommandReader::Parse, this) {}
 
-	~CuckooHolder() {
-		delete data_;
-	}
+	CommandReader(const CommandReader&) = delete;
+	CommandReader& operator=(const CommandReader&) = delete;
 
-	// Checks whether there is a given fingerprint in the bucket.
-	bool CheckInBucket(size_t bucket_id, fingerprint_t f) const {
-		for (size_t i = BUCKET_SIZE * bucket_id; i < BUCKET_SIZE * (bucket_id + 1); ++i) {
-			if (data_[i] == f) {
-				return true;
-			}
+	~CommandReader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopped_ = true;
 		}
-		return false;
+		not_full_.notify_one();
+		thread_.join();
 	}
 
-	size_t GetNumOfBuckets() const {
-		return num_of_buckets_;
-	}
-
-	// Swaps a given fingerprint with a random fingerprint from the bucket.
-	void SwapWithRandomFromBucket(size_t bucket_id, fingerprint_t& f) {
-		size_t rnd = rrand() % BUCKET_SIZE;
-		fingerprint_t tmp = data_[BUCKET_SIZE * bucket_id + rnd];
-		data_[BUCKET_SIZE * bucket_id + rnd] = f;
-		f = tmp;
+	// Takes the next batch of commands. Returns false at the end of the input.
+	bool Next(std::vector<Command>& batch) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_empty_.wait(lock, [this] { return !batches_.empty() || finished_; });
+		if (batches_.empty()) {
+			return false;
+		}
+		batch = std::move(batches_.front());
+		batches_.pop_front();
+		not_full_.notify_one();
+		return true;
 	}
 
-	// Adds f to the bucket if there is empty entry.
-	bool TryAdd(size_t bucket_id, fingerprint_t f) {
-		int empty_bucket_entry_id = -1;
-		for (int i = BUCKET_SIZE - 1; i >= 0; --i) {
-			if (data_[BUCKET_SIZE * bucket_id + i] == f) {
-				// Already in the bucket, no need to add.
-				return true;
-			}
-			if (data_[BUCKET_SIZE * bucket_id + i] == 0) {
-				empty_bucket_entry_id = i;
+private:
+	std::string_view text_;
+	std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+	std::deque<std::vector<Command>> batches_;
+	bool finished_ = false;
+	// Set when the reader is destroyed before the input ends.
+	bool stopped_ = false;
+	// Started last, when everything it uses is initialized.
+	std::thread thread_;
+
+	void Parse() {
+		std::vector<Command> batch;
+		while (!text_.empty()) {
+			batch.emplace_back();
+			ParseLine(NextLine(text_), batch.back());
+			if (batch.size() == BATCH_SIZE || text_.empty()) {
+				std::unique_lock<std::mutex> lock(mutex_);
+				not_full_.wait(lock, [this] { return batches_.size() < MAX_QUEUED_BATCHES || stopped_; });
+				if (stopped_) {
+					return;
+				}
+				batches_.push_back(std::move(batch));
+				not_empty_.notify_one();
+				batch.clear();
+				batch.reserve(BATCH_SIZE);
 			}
 		}
-		// If we've found empty entry we place the fingerprint in it.
-		if (empty_bucket_entry_id != -1) {
-			data_[BUCKET_SIZE * bucket_id + empty_bucket_entry_id] = f;
-			return true;
-		}
-		return false;
+		std::lock_guard<std::mutex> lock(mutex_);
+		finished_ = true;
+		not_empty_.notify_one();
 	}
-
-private:
-	fingerprint_t* data_;
-	size_t num_of_buckets_;
 };
 
-class CuckooFilter
-{
+/// <summary>
+/// Collects the answers into large blocks and writes them to the stream a block at a time.
+/// </summary>
+class OutputBuffer {
 public:
-	static constexpr double FAILURE_PROB{ 0.06 };
-	static constexpr int MAX_KICKS{ 500 };
+	static constexpr size_t BLOCK_SIZE{ 1 << 20 };
 
-	CuckooFilter(size_t num_of_elements) {
-		size_t size = static_cast<size_t>((1 + FAILURE_PROB) * num_of_elements / 4) + 1;
-		size = NextPowerOf2(size);
-		holder_ = new CuckooHolder(size);
-	}
+	explicit OutputBuffer(std::ostream& output) : output_(output), block_(new char[BLOCK_SIZE]) {}
 
-	~CuckooFilter() {
-		//delete[] precomputed_powers_;
-		delete holder_;
-	}
-
-	// Inserts string element to the filter.
-	bool Insert(const std::string& elem) {
-		fingerprint_t f = Fingerprint(elem);
-		size_t i1 = Hash(elem.c_str(), elem.size());
-		size_t i2 = (i1 ^ Hash(&f, 1)) % holder_->GetNumOfBuckets();
-
-		if (holder_->TryAdd(i1, f) || holder_->TryAdd(i1, f)) {
-			return true;
-		}
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
 
-		size_t i = rrand() % 2 ? i1 : i2;
-		for (int n = 0; n < MAX_KICKS; ++n) {
-			holder_->SwapWithRandomFromBucket(i, f);
-			i = (i ^ Hash(&f, 1)) % holder_->GetNumOfBuckets();
-			if (holder_->TryAdd(i, f)) {
-				return true;
-			}
-		}
-		return false;
+	~OutputBuffer() {
+		Flush();
 	}
 
-	// Checks whether the given element is in the filter. Can give a false positive (rarely).
-	bool Lookup(const std::string& elem) {
-		fingerprint_t f = Fingerprint(elem);
-		size_t i1 = Hash(elem.c_str(), elem.size());
-		size_t i2 = (i1 ^ Hash(&f, 1)) % holder_->GetNumOfBuckets();
-
-		if (holder_->CheckInBucket(i1, f) || holder_->CheckInBucket(i2, f)) {
-			return true;
+	void Write(std::string_view text) {
+		if (size_ + text.size() > BLOCK_SIZE) {
+			Flush();
 		}
-		return false;
+		std::memcpy(block_.get() + size_, text.data(), text.size());
+		size_ += text.size();
 	}
 
-private:
-	CuckooHolder* holder_;
-	static Powers powers;
-
-	// Returns a fingerprint (7-bit hash) of string value. Lowest bit is always 1.
-	fingerprint_t Fingerprint(const std::string& val) {
-		// 1 is used to indicate non-empty fingerprint (in case hash returns 0 particularly).
-		return static_cast<fingerprint_t>(std::hash<std::string>{}(val)) | 1;
+	void Flush() {
+		output_.write(block_.get(), static_cast<std::streamsize>(size_));
+		size_ = 0;
 	}
 
-	// Polynomial hash
-	size_t Hash(const char* bytes, size_t size) {
-		size_t hash = 0;
-		for (size_t i = 0; i < size; ++i) {
-			hash += powers.powers[i] * (static_cast<size_t>(bytes[i] - 'a') + 1);
-		}
-		return hash % holder_->GetNumOfBuckets();
-	}
+private:
+	std::ostream& output_;
+	std::unique_ptr<char[]> block_;
+	size_t size_ = 0;
 };
 
-Powers CuckooFilter::powers;
-
 /// <summary>
-/// Splits a line into three pieces: command, user and video.
+/// Processes the queries 'watch' and 'check' in input order. Consecutive checks of a batch see the same
+/// history, so they are answered together with one CheckBatch call. The history is flushed after every batch.
 /// </summary>
-void ParseLine(const std::string& line, std::string& command, std::string& user, std::string& video) {
-	size_t first_space = line.find(' ');
-	size_t second_space = first_space + 1 + line.substr(first_space + 1).find(' ');
-	command = line.substr(0, first_space);
-	user = line.substr(first_space + 1, second_space - first_space - 1);
-	video = line.substr(second_space + 1, line.substr(second_space + 1).find(' '));
+template <typename Store>
+void ProcessCommands(CommandReader& input, OutputBuffer& output, Store& video_history) {
+	std::vector<Command> batch;
+	std::vector<std::pair<std::string_view, std::string_view>> checks;
+	std::unique_ptr<bool[]> answers(new bool[CommandReader::BATCH_SIZE]);
+	while (input.Next(batch)) {
+		for (size_t i = 0; i < batch.size();) {
+			const Command& command = batch[i];
+			if (command.name == "watch") {
+				if (video_history.Watch(command.user, command.video)) {
+					output.Write("Ok\n");
+				}
+				else {
+					output.Write("Failed to insert\n");
+				}
+				++i;
+			}
+			else if (command.name == "check") {
+				checks.clear();
+				for (; i < batch.size() && batch[i].name == "check"; ++i) {
+					checks.emplace_back(batch[i].user, batch[i].video);
+				}
+				video_history.CheckBatch(checks.data(), checks.size(), answers.get());
+				for (size_t j = 0; j < checks.size(); ++j) {
+					output.Write(answers[j] ? "Probably\n" : "No\n");
+				}
+			}
+			else {
+				throw std::runtime_error("Terminated: unknown command \"" + std::string(command.name) + "\"");
+			}
+		}
+		video_history.Flush();
+	}
 }
 
 /// <summary>
-/// Main program logic.
+/// Main program logic. The input file is mapped and parsed in place. With a snapshot path, the history is
+/// loaded from the snapshot and new watches are appended to it (and folded into it once there are enough of them);
+/// if there is no such file yet, the history is built from the input and saved there.
 /// </summary>
-void Run(const char* ipath, const char* opath) {
+void Run(const char* ipath, const char* opath, const char* snapshot_path = nullptr) {
 	// Opening the files.
-	std::ifstream input;
-	input.open(ipath);
-	if (!input.is_open()) {
-		throw std::runtime_error("Cannot open file " + std::string(ipath));
-	}
+	MappedFile input(ipath);
 	std::ofstream output;
-	output.open(opath);
+	output.open(opath, std::ios::binary);
 	if (!output.is_open()) {
-		input.close();
 		throw std::runtime_error("Cannot open file " + std::string(opath));
 	}
 
 	// Reading the first line.
-	std::string line;
-	std::getline(input, line);
+	std::string_view text(input.GetData(), input.GetSize());
+	std::string_view line = NextLine(text);
 	if (line.substr(0, line.find(' ')) != "videos") {
 		throw std::runtime_error("Unexpected format: no \"videos\" found in the first line.");
 	}
-	int num_of_videos = stoi(line.substr(line.find(' ') + 1));
-	output << "Ok\n";
-
-	// Main part: reading each line and processing the queries 'watch' and 'check'.
-	std::map<const std::string, std::unique_ptr<CuckooFilter>> video_history;
-	std::string command, user, video;
-	while (std::getline(input, line)) {
-		ParseLine(line, command, user, video);
-		if (command == "watch") {
-			// Adding a new user if we don't find one.
-			if (video_history.find(user) == video_history.end()) {
-				video_history[user] =
-					std::unique_ptr<CuckooFilter>(new CuckooFilter(num_of_videos));
-			}
-			if (video_history[user]->Insert(video)) {
-				output << "Ok\n";
-			}
-			else {
-				output << "Failed to insert\n";
-			}
+	int num_of_videos = stoi(std::string(line.substr(line.find(' ') + 1)));
+	OutputBuffer answers(output);
+	answers.Write("Ok\n");
+
+	// Main part.
+	CommandReader commands(text);
+	if (snapshot_path != nullptr && std::ifstream(snapshot_path).is_open()) {
+		bool compact;
+		{
+			UserFilterSnapshot video_history(snapshot_path);
+			ProcessCommands(commands, answers, video_history);
+			compact = video_history.GetNumOfDeltas() >= UserFilterSnapshot::COMPACTION_THRESHOLD;
 		}
-		else if (command == "check") {
-			// Checking if that person exists and if so looking up the vid.
-			bool probably_cond =
-				video_history.find(user) != video_history.end()
-				&& video_history[user]->Lookup(video);
-			output << (probably_cond ? "Probably\n" : "No\n");
+		// The file is unmapped and the log closed before the snapshot is replaced.
+		if (compact) {
+			UserFilterSnapshot::Compact(snapshot_path);
 		}
-		else {
-			output.close();
-			input.close();
-			throw std::runtime_error("Terminated: unknown command \"" + command + "\"");
+	}
+	else {
+		UserFilterStore video_history(num_of_videos);
+		ProcessCommands(commands, answers, video_history);
+		if (snapshot_path != nullptr) {
+			video_history.SaveSnapshot(snapshot_path);
 		}
 	}
-
-	// Closing files.
-	output.close();
-	input.close();
 }
 
 int main(int argc, char* argv[]) {
-	if (argc != 3) {
-		std::cerr << "You must specify input and output files!" << std::endl;
+	if (argc != 3 && argc != 4) {
+		std::cerr << "You must specify input and output files (and optionally a snapshot file)!" << std::endl;
 		return 1;
 	}
 	try {
-		Run(argv[1], argv[2]);
+		Run(argv[1], argv[2], argc == 4 ? argv[3] : nullptr);
 	}
 	catch (std::runtime_error& e) {
 		std::cerr << e.what();
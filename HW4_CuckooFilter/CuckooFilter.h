@@ -0,0 +1,1555 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <type_traits>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CUCKOO_HAS_SSE2 1
+#include <immintrin.h>
+#endif
+
+// Fingerprint width and bucket size of the filters used by Run. Can be overridden at compile time
+// (e.g. -DCUCKOO_FINGERPRINT_BITS=16) to trade memory per item against the false positive rate,
+// which is roughly 2 * bucket_size / 2^fingerprint_bits.
+#ifndef CUCKOO_FINGERPRINT_BITS
+#define CUCKOO_FINGERPRINT_BITS 12
+#endif
+#ifndef CUCKOO_BUCKET_SIZE
+#define CUCKOO_BUCKET_SIZE 4
+#endif
+// Set to 1 to store 4-entry buckets semi-sorted: one bit less per entry for some CPU time per bucket access.
+#ifndef CUCKOO_SEMI_SORTED
+#define CUCKOO_SEMI_SORTED 0
+#endif
+
+/// <summary>
+/// Smallest unsigned type able to hold a fingerprint of the given width. Zero is reserved for an empty entry.
+/// </summary>
+template <size_t FingerprintBits>
+using fingerprint_t = std::conditional_t<FingerprintBits <= 8, uint8_t,
+	std::conditional_t<FingerprintBits <= 16, uint16_t, uint32_t>>;
+
+// Returns the next power of 2 of given value (e.g. 5 -> 8).
+inline size_t NextPowerOf2(size_t n) {
+	n--;
+	n |= n >> 1;
+	n |= n >> 2;
+	n |= n >> 4;
+	n |= n >> 8;
+	n |= n >> 16;
+	n++;
+	return n;
+}
+
+// Returns a mask with the lowest `bits` bits set.
+constexpr uint64_t LowBitsMask(size_t bits) {
+	return bits >= 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << bits) - 1;
+}
+
+// Returns a word made of `lanes` copies of `value`, each `lane_bits` wide (e.g. 0x01, 8, 3 -> 0x010101).
+constexpr uint64_t RepeatLanes(uint64_t value, size_t lane_bits, size_t lanes) {
+	uint64_t result = 0;
+	for (size_t i = 0; i < lanes; ++i) {
+		result |= value << (i * lane_bits);
+	}
+	return result;
+}
+
+// Hints the CPU to start loading the cache line with the given address.
+inline void Prefetch(const void* address) {
+#if defined(CUCKOO_HAS_SSE2)
+	_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+	__builtin_prefetch(address);
+#endif
+}
+
+// Reads 8 (4) bytes starting at the given address as a little-endian integer.
+inline uint64_t Read64(const char* bytes) {
+	uint64_t value;
+	std::memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+inline uint64_t Read32(const char* bytes) {
+	uint32_t value;
+	std::memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+constexpr uint64_t RotateLeft(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// 64-bit xxHash (XXH64) of the bytes. Reads the key once, 32 bytes per step, and works for any length.
+inline uint64_t Hash64(const char* bytes, size_t size, uint64_t seed = 0) {
+	constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,
+		P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+	auto round = [](uint64_t acc, uint64_t input) {
+		return RotateLeft(acc + input * P2, 31) * P1;
+	};
+	auto merge_round = [&round](uint64_t acc, uint64_t value) {
+		return (acc ^ round(0, value)) * P1 + P4;
+	};
+
+	const char* end = bytes + size;
+	uint64_t hash;
+	if (size >= 32) {
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		for (; end - bytes >= 32; bytes += 32) {
+			v1 = round(v1, Read64(bytes));
+			v2 = round(v2, Read64(bytes + 8));
+			v3 = round(v3, Read64(bytes + 16));
+			v4 = round(v4, Read64(bytes + 24));
+		}
+		hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+		hash = merge_round(merge_round(merge_round(merge_round(hash, v1), v2), v3), v4);
+	} else {
+		hash = seed + P5;
+	}
+	hash += size;
+
+	for (; end - bytes >= 8; bytes += 8) {
+		hash = RotateLeft(hash ^ round(0, Read64(bytes)), 27) * P1 + P4;
+	}
+	if (end - bytes >= 4) {
+		hash = RotateLeft(hash ^ (Read32(bytes) * P1), 23) * P2 + P3;
+		bytes += 4;
+	}
+	for (; bytes < end; ++bytes) {
+		hash = RotateLeft(hash ^ (static_cast<unsigned char>(*bytes) * P5), 11) * P1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= P2;
+	hash ^= hash >> 29;
+	hash *= P3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+inline uint64_t Hash64(std::string_view value, uint64_t seed = 0) {
+	return Hash64(value.data(), value.size(), seed);
+}
+
+// Words of the buckets are accessed through these, so that one holder serves both plain words and the atomic
+// words of the concurrent filter. Updates of atomic words are atomic read-modify-writes, as a word can be shared
+// by buckets guarded by different locks.
+inline uint64_t LoadWord(const uint64_t& word) {
+	return word;
+}
+
+inline uint64_t LoadWord(const std::atomic<uint64_t>& word) {
+	return word.load(std::memory_order_relaxed);
+}
+
+inline void UpdateWord(uint64_t& word, uint64_t clear_mask, uint64_t bits) {
+	word = (word & ~clear_mask) | bits;
+}
+
+inline void UpdateWord(std::atomic<uint64_t>& word, uint64_t clear_mask, uint64_t bits) {
+	word.fetch_and(~clear_mask, std::memory_order_relaxed);
+	word.fetch_or(bits, std::memory_order_relaxed);
+}
+
+// Tables for semi-sorted buckets: codes of the 3876 non-decreasing tuples of four 4-bit values.
+// A tuple is packed into 16 bits, its first (smallest) value in the lowest nibble.
+class SemiSortTables {
+public:
+	static constexpr size_t NUM_OF_CODES{ 3876 };
+	// Bits needed for a code.
+	static constexpr size_t CODE_BITS{ 12 };
+
+	uint16_t decode[NUM_OF_CODES];
+	// Only the entries of non-decreasing tuples are meaningful.
+	uint16_t encode[1 << 16];
+
+	static const SemiSortTables& Get() {
+		static const SemiSortTables tables;
+		return tables;
+	}
+
+private:
+	SemiSortTables() : encode{} {
+		uint16_t code = 0;
+		for (uint16_t a = 0; a < 16; ++a) {
+			for (uint16_t b = a; b < 16; ++b) {
+				for (uint16_t c = b; c < 16; ++c) {
+					for (uint16_t d = c; d < 16; ++d) {
+						uint16_t packed = static_cast<uint16_t>(a | (b << 4) | (c << 8) | (d << 12));
+						decode[code] = packed;
+						encode[packed] = code++;
+					}
+				}
+			}
+		}
+	}
+};
+
+// Holds cuckoo filter information (buckets). Fingerprints are bit-packed one after another
+// into 64-bit words, so an entry costs exactly FingerprintBits bits and may span two words.
+// With SemiSorted (4-entry buckets only) the fingerprints of a bucket are kept sorted, which makes the tuple
+// of their high 4 bits one of only 3876 values: it is stored as a 12-bit code instead of 16 bits,
+// followed by the low bits of the fingerprints. This saves one bit per entry.
+template <size_t FingerprintBits, size_t BucketSize, bool SemiSorted = false, typename Word = uint64_t>
+class CuckooHolder {
+public:
+	static_assert(FingerprintBits >= 2 && FingerprintBits <= 32, "Fingerprint must be 2 to 32 bits wide.");
+	static_assert(BucketSize >= 1 && BucketSize <= 8, "Bucket must hold 1 to 8 fingerprints.");
+	static_assert(!SemiSorted || (BucketSize == 4 && FingerprintBits > 4),
+		"Semi-sorted buckets hold 4 fingerprints of more than 4 bits.");
+
+	using fingerprint_type = fingerprint_t<FingerprintBits>;
+
+	// Size of one bucket in fingerprints.
+	static constexpr size_t BUCKET_SIZE{ BucketSize };
+	// Size of one fingerprint in bits.
+	static constexpr size_t FINGERPRINT_BITS{ FingerprintBits };
+	// Size of one bucket in bits.
+	static constexpr size_t BUCKET_BITS{
+		SemiSorted ? SemiSortTables::CODE_BITS + BUCKET_SIZE * (FINGERPRINT_BITS - 4) : BUCKET_SIZE * FINGERPRINT_BITS };
+
+	explicit CuckooHolder(size_t num_of_buckets)
+		: owned_data_(new Word[NumOfWords(num_of_buckets)]{}), data_(owned_data_.get()), num_of_buckets_(num_of_buckets) {}
+
+	// Read-only holder over buckets stored elsewhere (e.g. in a mapped snapshot) that must outlive it.
+	// Only the const methods may be called.
+	CuckooHolder(const Word* data, size_t num_of_buckets)
+		: data_(const_cast<Word*>(data)), num_of_buckets_(num_of_buckets) {}
+
+	// Owning copy of the buckets of another holder, e.g. of a read-only one.
+	CuckooHolder(const CuckooHolder& other)
+		: owned_data_(new Word[NumOfWords(other.num_of_buckets_)]), data_(owned_data_.get()),
+		num_of_buckets_(other.num_of_buckets_) {
+		std::copy(other.data_, other.data_ + NumOfWords(num_of_buckets_), data_);
+	}
+
+	CuckooHolder& operator=(const CuckooHolder&) = delete;
+
+	// Splits one 64-bit hash of an element into its fingerprint (high half) and first bucket (low half),
+	// the second bucket is derived from the first one and the fingerprint.
+	void GetCandidates(uint64_t hash, fingerprint_type& f, size_t& i1, size_t& i2) const {
+		f = static_cast<fingerprint_type>((hash >> 32) & LowBitsMask(FINGERPRINT_BITS));
+		// 0 marks an empty entry.
+		if (f == 0) {
+			f = 1;
+		}
+		i1 = static_cast<size_t>(hash) & (num_of_buckets_ - 1);
+		i2 = GetAlternateBucket(i1, f);
+	}
+
+	// Partial-key cuckoo hashing: the other bucket of a fingerprint stored in bucket i. Works in both directions
+	// because the number of buckets is a power of 2.
+	size_t GetAlternateBucket(size_t i, fingerprint_type f) const {
+		uint64_t mixed = f * 0x9E3779B97F4A7C15ULL;
+		mixed ^= mixed >> 32;
+		return (i ^ static_cast<size_t>(mixed)) & (num_of_buckets_ - 1);
+	}
+
+	// Checks whether there is a given fingerprint in the bucket. Compares f against the whole bucket at once:
+	// with one SSE2/AVX2 compare when entries are whole 8/16/32-bit lanes of a 128/256-bit bucket,
+	// otherwise with a SWAR zero-lane test on each 64-bit window of the bucket.
+	bool CheckInBucket(size_t bucket_id, fingerprint_type f) const {
+		if constexpr (SemiSorted) {
+			fingerprint_type entries[BUCKET_SIZE];
+			ReadBucket(bucket_id, entries);
+			return entries[0] == f || entries[1] == f || entries[2] == f || entries[3] == f;
+		}
+#if defined(CUCKOO_HAS_SSE2)
+		if constexpr (IS_VECTOR_BUCKET && std::is_same_v<Word, uint64_t>) {
+			return CheckInBucketVector(bucket_id, f);
+		}
+#endif
+		constexpr size_t lanes = std::min(BUCKET_SIZE, 64 / FINGERPRINT_BITS);
+		constexpr size_t window_bits = lanes * FINGERPRINT_BITS;
+		constexpr uint64_t low = RepeatLanes(1, FINGERPRINT_BITS, lanes);
+		constexpr uint64_t high = RepeatLanes(uint64_t{ 1 } << (FINGERPRINT_BITS - 1), FINGERPRINT_BITS, lanes);
+		const uint64_t pattern = low * f;
+		size_t offset = bucket_id * BUCKET_BITS;
+		for (size_t i = 0; i < BUCKET_SIZE; i += lanes, offset += window_bits) {
+			size_t width = std::min(lanes, BUCKET_SIZE - i) * FINGERPRINT_BITS;
+			// Lanes equal to f become zero; the last window may be partial, its missing lanes stay non-zero.
+			uint64_t diff = (ReadBits(offset, width) ^ pattern) | (~LowBitsMask(width) & low);
+			if (((diff - low) & ~diff & high) != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Starts loading the bucket into the cache ahead of CheckInBucket/TryAdd.
+	void PrefetchBucket(size_t bucket_id) const {
+		size_t offset = bucket_id * BUCKET_BITS;
+		Prefetch(&data_[offset / 64]);
+		if (BUCKET_BITS > 64) {
+			Prefetch(&data_[(offset + BUCKET_BITS - 1) / 64]);
+		}
+	}
+
+	size_t GetNumOfBuckets() const {
+		return num_of_buckets_;
+	}
+
+	// Memory used by the buckets in bytes.
+	size_t GetSizeInBytes() const {
+		return NumOfWords(num_of_buckets_) * sizeof(Word);
+	}
+
+	// Number of 64-bit words taken by the given number of buckets.
+	static size_t NumOfWords(size_t num_of_buckets) {
+		return (num_of_buckets * BUCKET_BITS + 63) / 64;
+	}
+
+	// Raw bucket words, GetSizeInBytes() bytes.
+	const Word* GetData() const {
+		return data_;
+	}
+
+	// Reads all fingerprints of the bucket.
+	void ReadBucket(size_t bucket_id, fingerprint_type (&entries)[BUCKET_SIZE]) const {
+		size_t offset = bucket_id * BUCKET_BITS;
+		if constexpr (SemiSorted) {
+			uint16_t prefixes = SemiSortTables::Get().decode[ReadBits(offset, SemiSortTables::CODE_BITS)];
+			offset += SemiSortTables::CODE_BITS;
+			for (size_t i = 0; i < BUCKET_SIZE; ++i, offset += LOW_BITS) {
+				entries[i] = static_cast<fingerprint_type>(
+					(static_cast<uint64_t>((prefixes >> (4 * i)) & 0xF) << LOW_BITS) | ReadBits(offset, LOW_BITS));
+			}
+		} else {
+			for (size_t i = 0; i < BUCKET_SIZE; ++i, offset += FINGERPRINT_BITS) {
+				entries[i] = static_cast<fingerprint_type>(ReadBits(offset, FINGERPRINT_BITS));
+			}
+		}
+	}
+
+	// One step of an eviction path: fingerprint f is to be moved from the bucket to the bucket of the next step.
+	// The last step is a bucket with a free entry (f = 0).
+	struct EvictionStep {
+		size_t bucket;
+		fingerprint_type f;
+	};
+
+	// Breadth-first search for the shortest sequence of at most max_path_length moves that frees an entry
+	// in bucket i1 or i2. The buckets are not changed. At most 2 * (1 + b + ... + b^(L-1)) buckets are expanded
+	// (b = BUCKET_SIZE, L = max_path_length), which bounds the work of an insert.
+	bool FindEvictionPath(size_t i1, size_t i2, size_t max_path_length, std::vector<EvictionStep>& path) const {
+		thread_local std::vector<SearchNode> queue;
+		queue.clear();
+		queue.push_back({ i1, 0, NO_PARENT, 0 });
+		if (i2 != i1) {
+			queue.push_back({ i2, 0, NO_PARENT, 0 });
+		}
+
+		fingerprint_type entries[BUCKET_SIZE];
+		for (size_t head = 0; head < queue.size() && queue[head].depth < max_path_length; ++head) {
+			ReadBucket(queue[head].bucket, entries);
+			for (fingerprint_type f : entries) {
+				size_t next = GetAlternateBucket(queue[head].bucket, f);
+				if (IsOnSearchPath(queue, head, next)) {
+					continue;
+				}
+				queue.push_back({ next, f, head, queue[head].depth + 1 });
+				if (CheckInBucket(next, 0)) {
+					UnwindSearchPath(queue, queue.size() - 1, path);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Removes one copy of f from the bucket. Returns false if there is none.
+	bool Remove(size_t bucket_id, fingerprint_type f) {
+		fingerprint_type entries[BUCKET_SIZE];
+		ReadBucket(bucket_id, entries);
+		for (size_t i = 0; i < BUCKET_SIZE; ++i) {
+			if (entries[i] == f) {
+				Set(bucket_id, entries, i, 0);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Adds f to the bucket if there is empty entry.
+	bool TryAdd(size_t bucket_id, fingerprint_type f) {
+		fingerprint_type entries[BUCKET_SIZE];
+		ReadBucket(bucket_id, entries);
+		int empty_bucket_entry_id = -1;
+		for (int i = BUCKET_SIZE - 1; i >= 0; --i) {
+			fingerprint_type current = entries[i];
+			if (current == f) {
+				// Already in the bucket, no need to add.
+				return true;
+			}
+			if (current == 0) {
+				empty_bucket_entry_id = i;
+			}
+		}
+		// If we've found empty entry we place the fingerprint in it.
+		if (empty_bucket_entry_id != -1) {
+			Set(bucket_id, entries, empty_bucket_entry_id, f);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	// Whether a bucket is exactly one or two 128-bit vectors of whole 8/16/32-bit lanes.
+	static constexpr bool IS_VECTOR_BUCKET{ !SemiSorted
+		&& (FINGERPRINT_BITS == 8 || FINGERPRINT_BITS == 16 || FINGERPRINT_BITS == 32)
+		&& (BUCKET_BITS == 128 || BUCKET_BITS == 256) };
+	// Bits of a fingerprint stored as is in a semi-sorted bucket.
+	static constexpr size_t LOW_BITS{ FINGERPRINT_BITS - 4 };
+
+	// Bucket reached by the eviction path search.
+	struct SearchNode {
+		size_t bucket;
+		// Fingerprint moved from the parent bucket to this one.
+		fingerprint_type f;
+		size_t parent;
+		size_t depth;
+	};
+
+	static constexpr size_t NO_PARENT{ SIZE_MAX };
+
+	// Null if the buckets are not owned.
+	std::unique_ptr<Word[]> owned_data_;
+	Word* data_;
+	size_t num_of_buckets_;
+
+	// Whether the bucket is on the path from a root to the node. Such moves would run in circles.
+	static bool IsOnSearchPath(const std::vector<SearchNode>& queue, size_t node, size_t bucket) {
+		for (; node != NO_PARENT; node = queue[node].parent) {
+			if (queue[node].bucket == bucket) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void UnwindSearchPath(const std::vector<SearchNode>& queue, size_t node, std::vector<EvictionStep>& path) {
+		size_t depth = queue[node].depth;
+		path.resize(depth + 1);
+		path[depth] = { queue[node].bucket, 0 };
+		for (size_t k = depth; k-- > 0;) {
+			path[k].f = queue[node].f;
+			node = queue[node].parent;
+			path[k].bucket = queue[node].bucket;
+		}
+	}
+
+	// Reads `width` (at most 64) bits starting at the given bit offset.
+	uint64_t ReadBits(size_t offset, size_t width) const {
+		size_t word = offset / 64, shift = offset % 64;
+		uint64_t value = LoadWord(data_[word]) >> shift;
+		if (shift + width > 64) {
+			value |= LoadWord(data_[word + 1]) << (64 - shift);
+		}
+		return value & LowBitsMask(width);
+	}
+
+#if defined(CUCKOO_HAS_SSE2)
+	// Vector compare of f against every lane of a 128/256-bit bucket.
+	bool CheckInBucketVector(size_t bucket_id, fingerprint_type f) const {
+		const uint64_t* bucket = &data_[bucket_id * BUCKET_BITS / 64];
+#if defined(__AVX2__)
+		if constexpr (BUCKET_BITS == 256) {
+			__m256i entries = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bucket));
+			return _mm256_movemask_epi8(CompareLanes(entries, f)) != 0;
+		}
+#endif
+		int mask = 0;
+		for (size_t i = 0; i < BUCKET_BITS / 128; ++i) {
+			__m128i entries = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bucket + 2 * i));
+			mask |= _mm_movemask_epi8(CompareLanes(entries, f));
+		}
+		return mask != 0;
+	}
+
+	static __m128i CompareLanes(__m128i entries, fingerprint_type f) {
+		if constexpr (FINGERPRINT_BITS == 8) {
+			return _mm_cmpeq_epi8(entries, _mm_set1_epi8(static_cast<char>(f)));
+		} else if constexpr (FINGERPRINT_BITS == 16) {
+			return _mm_cmpeq_epi16(entries, _mm_set1_epi16(static_cast<short>(f)));
+		} else {
+			return _mm_cmpeq_epi32(entries, _mm_set1_epi32(static_cast<int>(f)));
+		}
+	}
+
+#if defined(__AVX2__)
+	static __m256i CompareLanes(__m256i entries, fingerprint_type f) {
+		if constexpr (FINGERPRINT_BITS == 8) {
+			return _mm256_cmpeq_epi8(entries, _mm256_set1_epi8(static_cast<char>(f)));
+		} else if constexpr (FINGERPRINT_BITS == 16) {
+			return _mm256_cmpeq_epi16(entries, _mm256_set1_epi16(static_cast<short>(f)));
+		} else {
+			return _mm256_cmpeq_epi32(entries, _mm256_set1_epi32(static_cast<int>(f)));
+		}
+	}
+#endif
+#endif
+
+	// Overwrites the given entry of the bucket (whose fingerprints are entries) with f.
+	void Set(size_t bucket_id, fingerprint_type (&entries)[BUCKET_SIZE], size_t entry_id, fingerprint_type f) {
+		if constexpr (SemiSorted) {
+			entries[entry_id] = f;
+			WriteSemiSortedBucket(bucket_id, entries);
+		} else {
+			WriteBits((bucket_id * BUCKET_SIZE + entry_id) * FINGERPRINT_BITS, FINGERPRINT_BITS, f);
+		}
+	}
+
+	// Sorts the fingerprints and stores them as the code of their high 4 bits followed by their low bits.
+	void WriteSemiSortedBucket(size_t bucket_id, fingerprint_type (&entries)[BUCKET_SIZE]) {
+		// Sorting network for 4 values.
+		auto order = [&entries](size_t i, size_t j) {
+			if (entries[j] < entries[i]) {
+				std::swap(entries[i], entries[j]);
+			}
+		};
+		order(0, 1);
+		order(2, 3);
+		order(0, 2);
+		order(1, 3);
+		order(1, 2);
+
+		uint16_t prefixes = 0;
+		for (size_t i = 0; i < BUCKET_SIZE; ++i) {
+			prefixes |= static_cast<uint16_t>((entries[i] >> LOW_BITS) << (4 * i));
+		}
+		size_t offset = bucket_id * BUCKET_BITS;
+		WriteBits(offset, SemiSortTables::CODE_BITS, SemiSortTables::Get().encode[prefixes]);
+		offset += SemiSortTables::CODE_BITS;
+		for (size_t i = 0; i < BUCKET_SIZE; ++i, offset += LOW_BITS) {
+			WriteBits(offset, LOW_BITS, entries[i] & LowBitsMask(LOW_BITS));
+		}
+	}
+
+	// Writes the lowest `width` (at most 64) bits of value starting at the given bit offset.
+	void WriteBits(size_t offset, size_t width, uint64_t value) {
+		size_t word = offset / 64, shift = offset % 64;
+		uint64_t mask = LowBitsMask(width);
+		UpdateWord(data_[word], mask << shift, value << shift);
+		if (shift + width > 64) {
+			size_t spilled = 64 - shift;
+			UpdateWord(data_[word + 1], mask >> spilled, value >> spilled);
+		}
+	}
+};
+
+template <size_t FingerprintBits = CUCKOO_FINGERPRINT_BITS, size_t BucketSize = CUCKOO_BUCKET_SIZE,
+	bool SemiSorted = CUCKOO_SEMI_SORTED>
+class CuckooFilter
+{
+public:
+	using Holder = CuckooHolder<FingerprintBits, BucketSize, SemiSorted>;
+	using fingerprint_type = typename Holder::fingerprint_type;
+
+	using EvictionStep = typename Holder::EvictionStep;
+
+	static constexpr double FAILURE_PROB{ 0.06 };
+	// Default limit of fingerprint moves per insert.
+	static constexpr size_t DEFAULT_MAX_PATH_LENGTH{ 5 };
+	// Number of keys hashed and prefetched together by LookupBatch.
+	static constexpr size_t BATCH_BLOCK{ 16 };
+
+	CuckooFilter(size_t num_of_elements, size_t max_path_length = DEFAULT_MAX_PATH_LENGTH)
+		: max_path_length_(max_path_length) {
+		size_t size = static_cast<size_t>((1 + FAILURE_PROB) * num_of_elements / BucketSize) + 1;
+		size = NextPowerOf2(size);
+		holder_ = new Holder(size);
+	}
+
+	// Filter with a copy of the given buckets, e.g. of a generation in a snapshot. Every stored fingerprint
+	// is counted as an item.
+	explicit CuckooFilter(const Holder& holder, size_t max_path_length = DEFAULT_MAX_PATH_LENGTH)
+		: holder_(new Holder(holder)), max_path_length_(max_path_length) {
+		fingerprint_type entries[BucketSize];
+		for (size_t i = 0; i < holder_->GetNumOfBuckets(); ++i) {
+			holder_->ReadBucket(i, entries);
+			num_of_items_ += static_cast<size_t>(std::count_if(entries, entries + BucketSize,
+				[](fingerprint_type f) { return f != 0; }));
+		}
+	}
+
+	CuckooFilter(const CuckooFilter&) = delete;
+	CuckooFilter& operator=(const CuckooFilter&) = delete;
+
+	~CuckooFilter() {
+		delete holder_;
+	}
+
+	// Inserts string element to the filter.
+	bool Insert(std::string_view elem) {
+		return InsertHash(Hash64(elem));
+	}
+
+	// Inserts an element given by its Hash64 (e.g. of a compound key). When both buckets are full, the shortest
+	// eviction path is searched first and the fingerprints are moved only if one is found, so a failed insert
+	// changes nothing.
+	bool InsertHash(uint64_t hash) {
+		fingerprint_type f;
+		size_t i1, i2;
+		holder_->GetCandidates(hash, f, i1, i2);
+
+		if (!holder_->TryAdd(i1, f) && !holder_->TryAdd(i2, f)) {
+			if (!holder_->FindEvictionPath(i1, i2, max_path_length_, path_)) {
+				return false;
+			}
+			// Moving from the free end, every move frees the entry the previous one needs.
+			for (size_t k = path_.size() - 1; k-- > 0;) {
+				holder_->TryAdd(path_[k + 1].bucket, path_[k].f);
+				holder_->Remove(path_[k].bucket, path_[k].f);
+			}
+			holder_->TryAdd(path_[0].bucket, f);
+		}
+		++num_of_items_;
+		return true;
+	}
+
+	// Checks whether the given element is in the filter. Can give a false positive (rarely).
+	bool Lookup(std::string_view elem) const {
+		return LookupHash(Hash64(elem));
+	}
+
+	// Checks whether an element given by its Hash64 is in the filter.
+	bool LookupHash(uint64_t hash) const {
+		fingerprint_type f;
+		size_t i1, i2;
+		holder_->GetCandidates(hash, f, i1, i2);
+
+		if (holder_->CheckInBucket(i1, f) || holder_->CheckInBucket(i2, f)) {
+			return true;
+		}
+		return false;
+	}
+
+	// Looks up count elements and writes the answers to results. Keys are processed in blocks:
+	// a block is hashed and both candidate buckets of every key are prefetched before any of them is probed,
+	// so the cache misses of the whole block overlap instead of being paid one by one.
+	void LookupBatch(const std::string* elems, size_t count, bool* results) const {
+		uint64_t hashes[BATCH_BLOCK];
+		for (size_t begin = 0; begin < count; begin += BATCH_BLOCK) {
+			size_t block = std::min(BATCH_BLOCK, count - begin);
+			for (size_t j = 0; j < block; ++j) {
+				hashes[j] = Hash64(elems[begin + j]);
+			}
+			LookupHashBatch(hashes, block, results + begin);
+		}
+	}
+
+	// The same for elements given by their Hash64.
+	void LookupHashBatch(const uint64_t* hashes, size_t count, bool* results) const {
+		fingerprint_type fingerprints[BATCH_BLOCK];
+		size_t first_buckets[BATCH_BLOCK], second_buckets[BATCH_BLOCK];
+		for (size_t begin = 0; begin < count; begin += BATCH_BLOCK) {
+			size_t block = std::min(BATCH_BLOCK, count - begin);
+			for (size_t j = 0; j < block; ++j) {
+				holder_->GetCandidates(hashes[begin + j], fingerprints[j], first_buckets[j], second_buckets[j]);
+				holder_->PrefetchBucket(first_buckets[j]);
+				holder_->PrefetchBucket(second_buckets[j]);
+			}
+			for (size_t j = 0; j < block; ++j) {
+				results[begin + j] = holder_->CheckInBucket(first_buckets[j], fingerprints[j])
+					|| holder_->CheckInBucket(second_buckets[j], fingerprints[j]);
+			}
+		}
+	}
+
+	std::vector<bool> LookupBatch(const std::vector<std::string>& elems) const {
+		std::unique_ptr<bool[]> results(new bool[elems.size()]);
+		LookupBatch(elems.data(), elems.size(), results.get());
+		return std::vector<bool>(results.get(), results.get() + elems.size());
+	}
+
+	// Memory used by the filter buckets in bytes.
+	size_t GetSizeInBytes() const {
+		return holder_->GetSizeInBytes();
+	}
+
+	// Number of insertions so far (repeated elements are counted every time).
+	size_t GetNumOfItems() const {
+		return num_of_items_;
+	}
+
+	// Number of fingerprints the buckets can hold.
+	size_t GetCapacity() const {
+		return holder_->GetNumOfBuckets() * BucketSize;
+	}
+
+	const Holder& GetHolder() const {
+		return *holder_;
+	}
+
+private:
+	Holder* holder_;
+	size_t max_path_length_;
+	size_t num_of_items_ = 0;
+	// Buffer for eviction paths.
+	std::vector<EvictionStep> path_;
+};
+
+/// <summary>
+/// Cuckoo filter that grows instead of failing: when the newest generation (a CuckooFilter) gets too full,
+/// a GROWTH_FACTOR times larger one is added and new elements go there. Lookups check every generation,
+/// so the false positive rates of the generations add up. To keep the sum under max_false_positive_rate however
+/// many generations are added, generation i gets the share (1 - TIGHTENING_RATIO) * TIGHTENING_RATIO^i of it,
+/// as in scalable Bloom filters. The fingerprints are of one width in all generations, so a generation keeps
+/// to its share by taking fewer items: once the share is below the rate of a generation at MAX_LOAD, the load limit
+/// shrinks TIGHTENING_RATIO times with every generation, while the capacity grows GROWTH_FACTOR times, so growth
+/// never stops, though narrow fingerprints make the later generations sparse.
+/// </summary>
+template <size_t FingerprintBits = CUCKOO_FINGERPRINT_BITS, size_t BucketSize = CUCKOO_BUCKET_SIZE,
+	bool SemiSorted = CUCKOO_SEMI_SORTED>
+class ScalableCuckooFilter {
+public:
+	using Filter = CuckooFilter<FingerprintBits, BucketSize, SemiSorted>;
+
+	static constexpr size_t GROWTH_FACTOR{ 4 };
+	// Share of a generation capacity that can be used before the next generation is added, a bit below
+	// the load factors the eviction path search reaches for the bucket size (about 50%, 83%, 97%, 99%).
+	static constexpr double MAX_LOAD{ BucketSize >= 8 ? 0.97 : BucketSize >= 4 ? 0.95 : BucketSize >= 2 ? 0.8 : 0.45 };
+	static constexpr double DEFAULT_MAX_FALSE_POSITIVE_RATE{ 0.05 };
+	// Ratio of the false positive rates of consecutive generations.
+	static constexpr double TIGHTENING_RATIO{ 0.75 };
+
+	explicit ScalableCuckooFilter(size_t initial_capacity,
+		double max_false_positive_rate = DEFAULT_MAX_FALSE_POSITIVE_RATE)
+		: next_capacity_(std::max<size_t>(initial_capacity, 1)), max_false_positive_rate_(max_false_positive_rate) {
+		AddGeneration();
+	}
+
+	// Filter made of existing generations, oldest first, e.g. those of a snapshot. They get the load limits
+	// they would have got had they been added by this filter.
+	explicit ScalableCuckooFilter(std::vector<std::unique_ptr<Filter>> generations,
+		double max_false_positive_rate = DEFAULT_MAX_FALSE_POSITIVE_RATE)
+		: next_capacity_(1), max_false_positive_rate_(max_false_positive_rate) {
+		for (auto& generation : generations) {
+			AddGeneration(std::move(generation));
+		}
+		if (generations_.empty()) {
+			AddGeneration();
+		}
+	}
+
+	bool Insert(std::string_view elem) {
+		return InsertHash(Hash64(elem));
+	}
+
+	bool InsertHash(uint64_t hash) {
+		// Repeated elements would otherwise take space in every generation.
+		if (LookupHash(hash)) {
+			return true;
+		}
+		Filter* newest = generations_.back().get();
+		if (newest->GetNumOfItems() >= max_items_.back()) {
+			AddGeneration();
+			newest = generations_.back().get();
+		}
+		if (newest->InsertHash(hash)) {
+			return true;
+		}
+		// The generation filled up before reaching its load limit.
+		AddGeneration();
+		return generations_.back()->InsertHash(hash);
+	}
+
+	bool Lookup(std::string_view elem) const {
+		return LookupHash(Hash64(elem));
+	}
+
+	bool LookupHash(uint64_t hash) const {
+		// Newest generations are the largest, so they are the most likely to hold the element.
+		for (auto it = generations_.rbegin(); it != generations_.rend(); ++it) {
+			if ((*it)->LookupHash(hash)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Looks up count elements given by their Hash64 with Filter::LookupHashBatch in every generation.
+	void LookupHashBatch(const uint64_t* hashes, size_t count, bool* results) const {
+		bool found[Filter::BATCH_BLOCK];
+		for (size_t begin = 0; begin < count; begin += Filter::BATCH_BLOCK) {
+			size_t block = std::min(Filter::BATCH_BLOCK, count - begin);
+			std::fill(results + begin, results + begin + block, false);
+			for (const auto& generation : generations_) {
+				generation->LookupHashBatch(hashes + begin, block, found);
+				for (size_t j = 0; j < block; ++j) {
+					results[begin + j] = results[begin + j] || found[j];
+				}
+			}
+		}
+	}
+
+	// Estimated false positive rate of a lookup over all generations at their current load.
+	double GetFalsePositiveRate() const {
+		double no_false_positive = 1;
+		for (const auto& generation : generations_) {
+			no_false_positive *= 1 - GetFalsePositiveRate(*generation, generation->GetNumOfItems());
+		}
+		return 1 - no_false_positive;
+	}
+
+	size_t GetNumOfGenerations() const {
+		return generations_.size();
+	}
+
+	const Filter& GetGeneration(size_t index) const {
+		return *generations_[index];
+	}
+
+	size_t GetNumOfItems() const {
+		size_t items = 0;
+		for (const auto& generation : generations_) {
+			items += generation->GetNumOfItems();
+		}
+		return items;
+	}
+
+	size_t GetSizeInBytes() const {
+		size_t size = 0;
+		for (const auto& generation : generations_) {
+			size += generation->GetSizeInBytes();
+		}
+		return size;
+	}
+
+private:
+	std::vector<std::unique_ptr<Filter>> generations_;
+	// Number of items each generation takes before the next one is added.
+	std::vector<size_t> max_items_;
+	size_t next_capacity_;
+	double max_false_positive_rate_;
+
+	// Chance that a lookup of an absent element matches one of the fingerprints in its two buckets.
+	static double GetFalsePositiveRate(const Filter& filter, size_t num_of_items) {
+		double load = std::min(1.0, static_cast<double>(num_of_items) / filter.GetCapacity());
+		return 1 - std::pow(1 - 1.0 / (LowBitsMask(FingerprintBits)), 2.0 * BucketSize * load);
+	}
+
+	void AddGeneration() {
+		AddGeneration(std::unique_ptr<Filter>(new Filter(next_capacity_)));
+	}
+
+	// Adds the generation with the load limit that keeps it within its share of the false positive rate.
+	void AddGeneration(std::unique_ptr<Filter> generation) {
+		double rate = max_false_positive_rate_ * (1 - TIGHTENING_RATIO)
+			* std::pow(TIGHTENING_RATIO, static_cast<double>(generations_.size()));
+		// The load at which GetFalsePositiveRate reaches the rate.
+		double load = std::log(1 - rate) / (2.0 * BucketSize * std::log(1 - 1.0 / LowBitsMask(FingerprintBits)));
+		max_items_.push_back(std::max<size_t>(1,
+			static_cast<size_t>(std::min(load, MAX_LOAD) * static_cast<double>(generation->GetCapacity()))));
+		// Filter adds FAILURE_PROB of slack and a bucket and rounds up to a power of two buckets, so the capacity
+		// asked for is less by as much, or it would double once more.
+		next_capacity_ = static_cast<size_t>((generation->GetCapacity() * GROWTH_FACTOR - BucketSize)
+			/ (1 + Filter::FAILURE_PROB));
+		generations_.push_back(std::move(generation));
+	}
+};
+
+/// <summary>
+/// Thread-safe cuckoo filter. Buckets are guarded by lock stripes, each with a version counter that is odd
+/// while a writer changes one of its buckets. Lookups take no locks: they read the versions of the two stripes,
+/// probe the buckets and start over if a version has changed meanwhile. Inserts lock the stripes of both
+/// buckets; when the buckets are full, an eviction path is found without locks and then applied from its free end,
+/// one move at a time. A move copies a fingerprint to its other bucket before clearing the old entry, so
+/// elements never disappear, and a move that finds the path changed by other writers makes Insert start over.
+/// </summary>
+template <size_t FingerprintBits = CUCKOO_FINGERPRINT_BITS, size_t BucketSize = CUCKOO_BUCKET_SIZE,
+	bool SemiSorted = CUCKOO_SEMI_SORTED>
+class ConcurrentCuckooFilter {
+public:
+	using Holder = CuckooHolder<FingerprintBits, BucketSize, SemiSorted, std::atomic<uint64_t>>;
+	using fingerprint_type = typename Holder::fingerprint_type;
+
+	using EvictionStep = typename Holder::EvictionStep;
+
+	static constexpr double FAILURE_PROB{ 0.06 };
+	static constexpr size_t DEFAULT_MAX_PATH_LENGTH{ 5 };
+	static constexpr size_t MAX_STRIPES{ 4096 };
+	// Number of times Insert starts over when other writers invalidate its cuckoo path.
+	static constexpr int MAX_RETRIES{ 16 };
+
+	explicit ConcurrentCuckooFilter(size_t num_of_elements, size_t max_path_length = DEFAULT_MAX_PATH_LENGTH)
+		: holder_(NextPowerOf2(static_cast<size_t>((1 + FAILURE_PROB) * num_of_elements / BucketSize) + 1)),
+		max_path_length_(max_path_length),
+		num_of_stripes_(std::min(MAX_STRIPES, holder_.GetNumOfBuckets())),
+		stripes_(new Stripe[num_of_stripes_]) {}
+
+	bool Insert(std::string_view elem) {
+		return InsertHash(Hash64(elem));
+	}
+
+	// Inserts an element given by its Hash64. Returns false if there is no room for it; nothing is lost then.
+	bool InsertHash(uint64_t hash) {
+		fingerprint_type f;
+		size_t i1, i2;
+		holder_.GetCandidates(hash, f, i1, i2);
+
+		std::vector<EvictionStep> path;
+		for (int attempt = 0; attempt < MAX_RETRIES; ++attempt) {
+			{
+				StripeGuard guard(*this, i1, i2);
+				if (holder_.TryAdd(i1, f) || holder_.TryAdd(i2, f)) {
+					num_of_items_.fetch_add(1, std::memory_order_relaxed);
+					return true;
+				}
+			}
+			// Freeing an entry in one of the buckets and trying again.
+			if (!holder_.FindEvictionPath(i1, i2, max_path_length_, path)) {
+				return false;
+			}
+			ApplyPath(path);
+		}
+		return false;
+	}
+
+	bool Lookup(std::string_view elem) const {
+		return LookupHash(Hash64(elem));
+	}
+
+	bool LookupHash(uint64_t hash) const {
+		fingerprint_type f;
+		size_t i1, i2;
+		holder_.GetCandidates(hash, f, i1, i2);
+
+		const Stripe& first = GetStripe(i1);
+		const Stripe& second = GetStripe(i2);
+		while (true) {
+			uint32_t first_version = first.version.load(std::memory_order_acquire);
+			uint32_t second_version = second.version.load(std::memory_order_acquire);
+			if ((first_version | second_version) & 1) {
+				// A writer is in the middle of changing one of the buckets.
+				std::this_thread::yield();
+				continue;
+			}
+			bool found = holder_.CheckInBucket(i1, f) || holder_.CheckInBucket(i2, f);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (first.version.load(std::memory_order_relaxed) == first_version
+				&& second.version.load(std::memory_order_relaxed) == second_version) {
+				return found;
+			}
+		}
+	}
+
+	size_t GetNumOfItems() const {
+		return num_of_items_.load(std::memory_order_relaxed);
+	}
+
+	size_t GetCapacity() const {
+		return holder_.GetNumOfBuckets() * BucketSize;
+	}
+
+	size_t GetSizeInBytes() const {
+		return holder_.GetSizeInBytes() + num_of_stripes_ * sizeof(Stripe);
+	}
+
+private:
+	struct alignas(64) Stripe {
+		std::mutex mutex;
+		std::atomic<uint32_t> version{ 0 };
+	};
+
+	// Locks the stripes of two buckets (in address order, so that writers do not deadlock) and keeps
+	// their versions odd until destroyed.
+	class StripeGuard {
+	public:
+		StripeGuard(ConcurrentCuckooFilter& filter, size_t first_bucket, size_t second_bucket)
+			: first_(&filter.GetStripe(first_bucket)), second_(&filter.GetStripe(second_bucket)) {
+			if (second_ < first_) {
+				std::swap(first_, second_);
+			}
+			Lock(first_);
+			if (second_ != first_) {
+				Lock(second_);
+			} else {
+				second_ = nullptr;
+			}
+		}
+
+		~StripeGuard() {
+			if (second_) {
+				Unlock(second_);
+			}
+			Unlock(first_);
+		}
+
+		StripeGuard(const StripeGuard&) = delete;
+		StripeGuard& operator=(const StripeGuard&) = delete;
+
+	private:
+		Stripe* first_;
+		Stripe* second_;
+
+		static void Lock(Stripe* stripe) {
+			stripe->mutex.lock();
+			stripe->version.store(stripe->version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+
+		static void Unlock(Stripe* stripe) {
+			stripe->version.store(stripe->version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			stripe->mutex.unlock();
+		}
+	};
+
+	Holder holder_;
+	size_t max_path_length_;
+	size_t num_of_stripes_;
+	std::unique_ptr<Stripe[]> stripes_;
+	std::atomic<size_t> num_of_items_{ 0 };
+
+	Stripe& GetStripe(size_t bucket_id) const {
+		return stripes_[bucket_id & (num_of_stripes_ - 1)];
+	}
+
+	// Makes the moves of the path, starting from the free end. Stops at the first move that is no longer possible.
+	void ApplyPath(const std::vector<EvictionStep>& path) {
+		for (size_t k = path.size() - 1; k-- > 0;) {
+			const EvictionStep& from = path[k];
+			StripeGuard guard(*this, from.bucket, path[k + 1].bucket);
+			if (!holder_.CheckInBucket(from.bucket, from.f) || !holder_.TryAdd(path[k + 1].bucket, from.f)) {
+				return;
+			}
+			holder_.Remove(from.bucket, from.f);
+		}
+	}
+};
+
+/// <summary>
+/// Read-only memory mapping of a whole file.
+/// </summary>
+class MappedFile {
+public:
+	explicit MappedFile(const char* path) {
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		size_ = static_cast<size_t>(size.QuadPart);
+		if (size_ > 0) {
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping != nullptr) {
+				data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int file = open(path, O_RDONLY);
+		if (file == -1) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+		struct stat info;
+		fstat(file, &info);
+		size_ = static_cast<size_t>(info.st_size);
+		if (size_ > 0) {
+			void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+			data_ = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+		}
+		close(file);
+#endif
+		if (size_ > 0 && data_ == nullptr) {
+			throw std::runtime_error("Cannot map file " + std::string(path));
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (data_ != nullptr) {
+#ifdef _WIN32
+			UnmapViewOfFile(data_);
+#else
+			munmap(const_cast<char*>(data_), size_);
+#endif
+		}
+	}
+
+	const char* GetData() const {
+		return data_;
+	}
+
+	size_t GetSize() const {
+		return size_;
+	}
+
+private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+// Snapshot file of a UserFilterStore, in native byte order:
+// SnapshotHeader, SnapshotGeneration[num_of_generations] (generations of the shared filter first),
+// SnapshotUser[num_of_users] sorted by user hash, the bucket words of every generation (each 64-byte aligned),
+// and then the delta records appended after the snapshot was written: uint32 user size, uint32 video size,
+// user, video.
+struct SnapshotHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint16_t fingerprint_bits;
+	uint8_t bucket_size;
+	uint8_t semi_sorted;
+	uint64_t videos_per_user;
+	uint64_t num_of_users;
+	uint64_t num_of_generations;
+	uint64_t num_of_shared_generations;
+	// Offset of the first delta record, the end of the snapshot itself.
+	uint64_t deltas_offset;
+};
+
+struct SnapshotGeneration {
+	uint64_t num_of_buckets;
+	// Offset of the bucket words in the file.
+	uint64_t offset;
+};
+
+struct SnapshotUser {
+	uint64_t hash;
+	uint32_t watches;
+	uint32_t in_shared;
+	// Generations of the dedicated filter, oldest first.
+	uint32_t first_generation;
+	uint32_t num_of_generations;
+};
+
+// "CKFSNAP" and a format version byte.
+constexpr uint64_t SNAPSHOT_MAGIC{ 0x01504E5346464B43ULL };
+constexpr uint32_t SNAPSHOT_VERSION{ 1 };
+
+inline uint64_t AlignSnapshotOffset(uint64_t offset) {
+	return (offset + 63) & ~uint64_t{ 63 };
+}
+
+/// <summary>
+/// Watch history of all users. Users are identified by the Hash64 of their name, so names are not kept
+/// (a collision of two names only adds false positives). Users with few watches share one filter keyed on
+/// (user, video); once a user reaches PROMOTION_THRESHOLD watches, further videos go to a dedicated filter.
+/// All filters start small and grow with the watches, so memory follows the number of watches
+/// instead of users * catalogue size.
+/// </summary>
+class UserFilterStore {
+public:
+	using Filter = ScalableCuckooFilter<>;
+	using Holder = Filter::Filter::Holder;
+
+	// Number of watches after which a user gets a dedicated filter.
+	static constexpr uint32_t PROMOTION_THRESHOLD{ 32 };
+	// Default number of (user, video) pairs the first generation of the shared filter is sized for.
+	static constexpr size_t DEFAULT_SHARED_CAPACITY{ 1 << 12 };
+	// Number of videos the first generation of a dedicated filter is sized for.
+	static constexpr size_t DEDICATED_CAPACITY{ 4 * PROMOTION_THRESHOLD };
+
+	explicit UserFilterStore(size_t videos_per_user, size_t shared_capacity = DEFAULT_SHARED_CAPACITY)
+		: videos_per_user_(videos_per_user), shared_(shared_capacity) {}
+
+	// Store with the given shared filter and no users, to be filled with AddUser.
+	UserFilterStore(size_t videos_per_user, Filter shared)
+		: videos_per_user_(videos_per_user), shared_(std::move(shared)) {}
+
+	// Adds a user as it was saved: the number of watches, whether some videos are in the shared filter
+	// and the dedicated filter (null if not promoted yet).
+	void AddUser(uint64_t user_hash, uint32_t watches, bool in_shared, std::unique_ptr<Filter> filter) {
+		UserEntry& entry = users_[user_hash];
+		entry.watches = watches;
+		entry.in_shared = in_shared;
+		entry.filter = std::move(filter);
+	}
+
+	// Remembers that the user has watched the video. Returns false if the video could not be inserted.
+	bool Watch(std::string_view user, std::string_view video) {
+		uint64_t user_hash = Hash64(user);
+		UserEntry& entry = users_[user_hash];
+		++entry.watches;
+		if (!entry.filter && entry.watches <= PROMOTION_THRESHOLD) {
+			entry.in_shared = true;
+			return shared_.InsertHash(Hash64(video, user_hash));
+		}
+		if (!entry.filter) {
+			entry.filter.reset(new Filter(std::min(videos_per_user_, DEDICATED_CAPACITY)));
+		}
+		return entry.filter->Insert(video);
+	}
+
+	// Checks whether the user has (probably) watched the video.
+	bool Check(std::string_view user, std::string_view video) const {
+		uint64_t user_hash = Hash64(user);
+		auto it = users_.find(user_hash);
+		if (it == users_.end()) {
+			return false;
+		}
+		const UserEntry& entry = it->second;
+		// Videos watched before the promotion stay in the shared filter.
+		return (entry.filter && entry.filter->Lookup(video))
+			|| (entry.in_shared && shared_.LookupHash(Hash64(video, user_hash)));
+	}
+
+	// Checks count (user, video) pairs at once. The shared filter, which holds the videos of most users, is probed
+	// with batched lookups, so its cache misses overlap; dedicated filters are probed one pair at a time.
+	void CheckBatch(const std::pair<std::string_view, std::string_view>* pairs, size_t count, bool* results) const {
+		constexpr size_t BLOCK = Filter::Filter::BATCH_BLOCK;
+		uint64_t shared_hashes[BLOCK];
+		size_t shared_positions[BLOCK];
+		bool found[BLOCK];
+		for (size_t begin = 0; begin < count; begin += BLOCK) {
+			size_t num_of_shared = 0;
+			for (size_t i = begin; i < std::min(count, begin + BLOCK); ++i) {
+				results[i] = false;
+				uint64_t user_hash = Hash64(pairs[i].first);
+				auto it = users_.find(user_hash);
+				if (it == users_.end()) {
+					continue;
+				}
+				const UserEntry& entry = it->second;
+				if (entry.filter && entry.filter->Lookup(pairs[i].second)) {
+					results[i] = true;
+				}
+				else if (entry.in_shared) {
+					shared_hashes[num_of_shared] = Hash64(pairs[i].second, user_hash);
+					shared_positions[num_of_shared++] = i;
+				}
+			}
+			shared_.LookupHashBatch(shared_hashes, num_of_shared, found);
+			for (size_t j = 0; j < num_of_shared; ++j) {
+				results[shared_positions[j]] = found[j];
+			}
+		}
+	}
+
+	size_t GetNumOfUsers() const {
+		return users_.size();
+	}
+
+	// Memory used by all filter buckets in bytes.
+	size_t GetSizeInBytes() const {
+		size_t size = shared_.GetSizeInBytes();
+		for (const auto& user : users_) {
+			if (user.second.filter) {
+				size += user.second.filter->GetSizeInBytes();
+			}
+		}
+		return size;
+	}
+
+	// Nothing is written before SaveSnapshot.
+	void Flush() {}
+
+	// Writes all filters to a snapshot file that UserFilterSnapshot maps without parsing.
+	void SaveSnapshot(const char* path) const {
+		std::vector<std::pair<uint64_t, const UserEntry*>> sorted_users;
+		sorted_users.reserve(users_.size());
+		for (const auto& user : users_) {
+			sorted_users.emplace_back(user.first, &user.second);
+		}
+		std::sort(sorted_users.begin(), sorted_users.end(),
+			[](const auto& left, const auto& right) { return left.first < right.first; });
+
+		std::vector<const Filter::Filter*> generations;
+		auto add_generations = [&generations](const Filter& filter) {
+			for (size_t i = 0; i < filter.GetNumOfGenerations(); ++i) {
+				generations.push_back(&filter.GetGeneration(i));
+			}
+		};
+		add_generations(shared_);
+		std::vector<SnapshotUser> users;
+		users.reserve(sorted_users.size());
+		for (const auto& [hash, entry] : sorted_users) {
+			SnapshotUser user{ hash, entry->watches, entry->in_shared, static_cast<uint32_t>(generations.size()), 0 };
+			if (entry->filter) {
+				user.num_of_generations = static_cast<uint32_t>(entry->filter->GetNumOfGenerations());
+				add_generations(*entry->filter);
+			}
+			users.push_back(user);
+		}
+
+		uint64_t offset = AlignSnapshotOffset(sizeof(SnapshotHeader)
+			+ generations.size() * sizeof(SnapshotGeneration) + users.size() * sizeof(SnapshotUser));
+		std::vector<SnapshotGeneration> records;
+		records.reserve(generations.size());
+		for (const auto* generation : generations) {
+			records.push_back({ generation->GetHolder().GetNumOfBuckets(), offset });
+			offset = AlignSnapshotOffset(offset + generation->GetSizeInBytes());
+		}
+		SnapshotHeader header{ SNAPSHOT_MAGIC, SNAPSHOT_VERSION, Holder::FINGERPRINT_BITS, Holder::BUCKET_SIZE,
+			CUCKOO_SEMI_SORTED, videos_per_user_, users.size(), generations.size(), shared_.GetNumOfGenerations(), offset };
+
+		std::ofstream output(path, std::ios::binary | std::ios::trunc);
+		if (!output.is_open()) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		output.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotGeneration));
+		output.write(reinterpret_cast<const char*>(users.data()), users.size() * sizeof(SnapshotUser));
+		for (size_t i = 0; i < generations.size(); ++i) {
+			PadTo(output, records[i].offset);
+			output.write(reinterpret_cast<const char*>(generations[i]->GetHolder().GetData()),
+				generations[i]->GetSizeInBytes());
+		}
+		PadTo(output, header.deltas_offset);
+		if (!output) {
+			throw std::runtime_error("Cannot write file " + std::string(path));
+		}
+	}
+
+private:
+
+	struct UserEntry {
+		uint32_t watches = 0;
+		// Whether some of the user's videos are in the shared filter.
+		bool in_shared = false;
+		// Dedicated filter, created on promotion.
+		std::unique_ptr<Filter> filter;
+	};
+
+	size_t videos_per_user_;
+	Filter shared_;
+	std::unordered_map<uint64_t, UserEntry> users_;
+
+	static void PadTo(std::ostream& output, uint64_t offset) {
+		static const char zeros[64] = {};
+		output.write(zeros, static_cast<std::streamsize>(offset - static_cast<uint64_t>(output.tellp())));
+	}
+};
+
+/// <summary>
+/// Watch history loaded from a UserFilterStore snapshot. The file is mapped as is: lookups binary search
+/// the user index and probe the bucket words inside the mapping, nothing is parsed or allocated per filter.
+/// Watches made after the snapshot are appended to the file as delta records and kept in a small
+/// UserFilterStore in memory; opening the snapshot replays the recorded deltas into it. Watches the mapped filters
+/// already answer are not recorded, and Compact folds the records into a new snapshot, so the log
+/// and the time to replay it stay bounded.
+/// </summary>
+class UserFilterSnapshot {
+public:
+	// Number of delta records after which the owner should Compact the snapshot.
+	static constexpr size_t COMPACTION_THRESHOLD{ 1 << 16 };
+
+	explicit UserFilterSnapshot(const char* path)
+		: file_(path), header_(ReadHeader(file_, path)), deltas_(static_cast<size_t>(header_->videos_per_user)) {
+		generations_ = reinterpret_cast<const SnapshotGeneration*>(file_.GetData() + sizeof(SnapshotHeader));
+		users_ = reinterpret_cast<const SnapshotUser*>(generations_ + header_->num_of_generations);
+		// Lookups mask bucket indices with num_of_buckets - 1, load whole vectors of the 64-byte aligned bucket
+		// words and read the generations a user refers to, so all of it must be sound before anything is looked up.
+		// The bounds are compared without adding to the offsets, which a damaged file may have made to wrap.
+		const uint64_t tables_end = reinterpret_cast<const char*>(users_ + header_->num_of_users) - file_.GetData();
+		for (size_t i = 0; i < header_->num_of_generations; ++i) {
+			uint64_t num_of_buckets = generations_[i].num_of_buckets;
+			if (num_of_buckets == 0 || (num_of_buckets & (num_of_buckets - 1)) != 0
+				|| num_of_buckets > header_->deltas_offset || NumOfBytes(generations_[i]) > header_->deltas_offset
+				|| generations_[i].offset % 64 != 0 || generations_[i].offset < tables_end
+				|| generations_[i].offset > header_->deltas_offset - NumOfBytes(generations_[i])) {
+				throw std::runtime_error("Damaged snapshot " + std::string(path));
+			}
+		}
+		if (header_->num_of_shared_generations > header_->num_of_generations) {
+			throw std::runtime_error("Damaged snapshot " + std::string(path));
+		}
+		for (size_t i = 0; i < header_->num_of_users; ++i) {
+			if (uint64_t{ users_[i].first_generation } + users_[i].num_of_generations > header_->num_of_generations) {
+				throw std::runtime_error("Damaged snapshot " + std::string(path));
+			}
+		}
+		ReplayDeltas();
+		delta_log_.open(path, std::ios::binary | std::ios::app);
+		if (!delta_log_.is_open()) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+	}
+
+	// Remembers that the user has watched the video, also in the snapshot file.
+	bool Watch(std::string_view user, std::string_view video) {
+		// Compact copies the mapped filters as they are, so whatever they answer stays answered. The filters
+		// of the deltas are rebuilt by it, and a false positive of theirs would not be.
+		if (CheckSnapshot(user, video)) {
+			return true;
+		}
+		uint32_t sizes[2] = { static_cast<uint32_t>(user.size()), static_cast<uint32_t>(video.size()) };
+		delta_log_.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+		delta_log_.write(user.data(), user.size());
+		delta_log_.write(video.data(), video.size());
+		++num_of_deltas_;
+		return deltas_.Watch(user, video);
+	}
+
+	bool Check(std::string_view user, std::string_view video) const {
+		return CheckSnapshot(user, video) || deltas_.Check(user, video);
+	}
+
+	// Checks count (user, video) pairs. The mapped filters are probed one pair at a time.
+	void CheckBatch(const std::pair<std::string_view, std::string_view>* pairs, size_t count, bool* results) const {
+		for (size_t i = 0; i < count; ++i) {
+			results[i] = Check(pairs[i].first, pairs[i].second);
+		}
+	}
+
+	size_t GetNumOfUsers() const {
+		return static_cast<size_t>(header_->num_of_users);
+	}
+
+	// Number of watches made after the snapshot was written.
+	size_t GetNumOfDeltas() const {
+		return num_of_deltas_;
+	}
+
+	// Hands the delta records written so far to the OS, so they survive the process. Called at batch boundaries.
+	void Flush() {
+		if (!delta_log_.flush()) {
+			throw std::runtime_error("Cannot write delta records");
+		}
+	}
+
+	// Copies the mapped filters into a UserFilterStore and applies the delta records of the file on top of them,
+	// so they go to the newest generations as if the history had never been saved.
+	UserFilterStore Load() const {
+		UserFilterStore store(static_cast<size_t>(header_->videos_per_user),
+			LoadFilter(0, static_cast<size_t>(header_->num_of_shared_generations)));
+		for (size_t i = 0; i < header_->num_of_users; ++i) {
+			std::unique_ptr<Filter> filter;
+			if (users_[i].num_of_generations > 0) {
+				filter.reset(new Filter(LoadFilter(users_[i].first_generation, users_[i].num_of_generations)));
+			}
+			store.AddUser(users_[i].hash, users_[i].watches, users_[i].in_shared != 0, std::move(filter));
+		}
+		ForEachDelta([&store](std::string_view user, std::string_view video) { store.Watch(user, video); });
+		return store;
+	}
+
+	// Replaces the snapshot file with a new one that has its delta records folded in. The new snapshot
+	// is written next to it and renamed over it, so an interrupted compaction leaves the old file in place.
+	static void Compact(const char* path) {
+		const std::string new_path = std::string(path) + ".new";
+		{
+			UserFilterSnapshot snapshot(path);
+			snapshot.Load().SaveSnapshot(new_path.c_str());
+		}
+		std::filesystem::rename(new_path, path);
+	}
+
+private:
+	using Filter = UserFilterStore::Filter;
+	using Holder = UserFilterStore::Holder;
+
+	MappedFile file_;
+	const SnapshotHeader* header_;
+	const SnapshotGeneration* generations_;
+	const SnapshotUser* users_;
+	UserFilterStore deltas_;
+	size_t num_of_deltas_ = 0;
+	std::ofstream delta_log_;
+
+	static const SnapshotHeader* ReadHeader(const MappedFile& file, const char* path) {
+		const auto* header = reinterpret_cast<const SnapshotHeader*>(file.GetData());
+		if (file.GetSize() < sizeof(SnapshotHeader) || header->magic != SNAPSHOT_MAGIC
+			|| header->version != SNAPSHOT_VERSION) {
+			throw std::runtime_error("Not a snapshot: " + std::string(path));
+		}
+		if (header->fingerprint_bits != Holder::FINGERPRINT_BITS || header->bucket_size != Holder::BUCKET_SIZE
+			|| header->semi_sorted != CUCKOO_SEMI_SORTED) {
+			throw std::runtime_error("Snapshot " + std::string(path) + " was written with other filter parameters.");
+		}
+		uint64_t index_size = sizeof(SnapshotHeader) + header->num_of_generations * sizeof(SnapshotGeneration)
+			+ header->num_of_users * sizeof(SnapshotUser);
+		if (header->deltas_offset > file.GetSize() || index_size > header->deltas_offset) {
+			throw std::runtime_error("Damaged snapshot " + std::string(path));
+		}
+		return header;
+	}
+
+	static uint64_t NumOfBytes(const SnapshotGeneration& generation) {
+		return Holder::NumOfWords(static_cast<size_t>(generation.num_of_buckets)) * sizeof(uint64_t);
+	}
+
+	bool CheckSnapshot(std::string_view user, std::string_view video) const {
+		uint64_t user_hash = Hash64(user);
+		const SnapshotUser* end = users_ + header_->num_of_users;
+		const SnapshotUser* it = std::lower_bound(users_, end, user_hash,
+			[](const SnapshotUser& entry, uint64_t hash) { return entry.hash < hash; });
+		if (it == end || it->hash != user_hash) {
+			return false;
+		}
+		return LookupGenerations(it->first_generation, it->num_of_generations, Hash64(video))
+			|| (it->in_shared && LookupGenerations(0, static_cast<size_t>(header_->num_of_shared_generations),
+				Hash64(video, user_hash)));
+	}
+
+	// Looks the element up in the given generations of a filter, newest first.
+	bool LookupGenerations(size_t first, size_t count, uint64_t hash) const {
+		for (size_t i = first + count; i-- > first;) {
+			Holder holder(reinterpret_cast<const uint64_t*>(file_.GetData() + generations_[i].offset),
+				static_cast<size_t>(generations_[i].num_of_buckets));
+			typename Holder::fingerprint_type f;
+			size_t i1, i2;
+			holder.GetCandidates(hash, f, i1, i2);
+			if (holder.CheckInBucket(i1, f) || holder.CheckInBucket(i2, f)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Copies the given generations of a filter out of the mapping.
+	Filter LoadFilter(size_t first, size_t count) const {
+		std::vector<std::unique_ptr<Filter::Filter>> generations;
+		for (size_t i = first; i < first + count; ++i) {
+			Holder holder(reinterpret_cast<const uint64_t*>(file_.GetData() + generations_[i].offset),
+				static_cast<size_t>(generations_[i].num_of_buckets));
+			generations.emplace_back(new Filter::Filter(holder));
+		}
+		return Filter(std::move(generations));
+	}
+
+	void ReplayDeltas() {
+		ForEachDelta([this](std::string_view user, std::string_view video) {
+			deltas_.Watch(user, video);
+			++num_of_deltas_;
+		});
+	}
+
+	// Calls callback(user, video) for every delta record in the mapping. A torn record at the end
+	// (an interrupted write) is ignored.
+	template <typename Callback>
+	void ForEachDelta(Callback callback) const {
+		const char* position = file_.GetData() + header_->deltas_offset;
+		const char* end = file_.GetData() + file_.GetSize();
+		uint32_t sizes[2];
+		while (static_cast<size_t>(end - position) >= sizeof(sizes)) {
+			std::memcpy(sizes, position, sizeof(sizes));
+			position += sizeof(sizes);
+			if (static_cast<uint64_t>(end - position) < uint64_t{ sizes[0] } + sizes[1]) {
+				break;
+			}
+			callback(std::string_view(position, sizes[0]), std::string_view(position + sizes[0], sizes[1]));
+			position += sizes[0] + sizes[1];
+		}
+	}
+};
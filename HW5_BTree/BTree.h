@@ -0,0 +1,2920 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BTREE_HAS_SSE2 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+template <typename Key, typename Value>
+struct BasicKeyValuePair {
+	Key key;
+	Value value;
+};
+
+using KeyValuePair = BasicKeyValuePair<int, int>;
+
+template <typename Value>
+struct BasicSearchResponse {
+	bool is_found;
+	Value value;
+};
+
+using SearchResponse = BasicSearchResponse<int>;
+
+// Number of keys compared at once by CountLess. Key arrays have this many keys of padding after them,
+// so a vector load starting at any key stays inside the array.
+constexpr int KEY_LANES{ 8 };
+// Number of keys left by the binary part of KeySearch to CountLess.
+constexpr int SEARCH_WINDOW{ 2 * KEY_LANES };
+
+inline int CountBits(unsigned mask) {
+#if defined(_MSC_VER)
+	return static_cast<int>(__popcnt(mask));
+#else
+	return __builtin_popcount(mask);
+#endif
+}
+
+// Number of the first `length` keys that are less than the key.
+inline int CountLess(const int* keys, int length, int key) {
+	int count = 0;
+#if defined(__AVX2__)
+	const __m256i pattern = _mm256_set1_epi32(key);
+	for (int i = 0; i < length; i += 8) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+		unsigned less = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(pattern, chunk))));
+		// Lanes past the window are ignored.
+		count += CountBits(less & ((1u << std::min(8, length - i)) - 1));
+	}
+#elif defined(BTREE_HAS_SSE2)
+	const __m128i pattern = _mm_set1_epi32(key);
+	for (int i = 0; i < length; i += 4) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+		unsigned less = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(pattern, chunk))));
+		count += CountBits(less & ((1u << std::min(4, length - i)) - 1));
+	}
+#else
+	for (int i = 0; i < length; ++i) {
+		count += keys[i] < key ? 1 : 0;
+	}
+#endif
+	return count;
+}
+
+// The same for 64-bit keys. SSE2 has no 64-bit compare, so without SSE4.2 the keys are compared one by one.
+inline int CountLess(const int64_t* keys, int length, int64_t key) {
+	int count = 0;
+#if defined(__AVX2__)
+	const __m256i pattern = _mm256_set1_epi64x(key);
+	for (int i = 0; i < length; i += 4) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+		unsigned less = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(pattern, chunk))));
+		count += CountBits(less & ((1u << std::min(4, length - i)) - 1));
+	}
+#elif defined(__SSE4_2__)
+	const __m128i pattern = _mm_set1_epi64x(key);
+	for (int i = 0; i < length; i += 2) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+		unsigned less = static_cast<unsigned>(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(pattern, chunk))));
+		count += CountBits(less & ((1u << std::min(2, length - i)) - 1));
+	}
+#else
+	for (int i = 0; i < length; ++i) {
+		count += keys[i] < key ? 1 : 0;
+	}
+#endif
+	return count;
+}
+
+// Upper-bound search in the sorted keys: the position of the key or of the first greater one.
+// A branchless binary search narrows the keys down to a window of at most SEARCH_WINDOW keys holding
+// the position (the keys before the window are less than the key, the keys after it are not),
+// and then the keys of the window less than the key are counted with vector compares.
+template <typename Key>
+int VectorKeySearch(const Key* keys, int size, Key key) {
+	int base = 0;
+	int length = size;
+	while (length > SEARCH_WINDOW) {
+		int half = length / 2;
+		base = keys[base + half] < key ? base + half : base;
+		length -= half;
+	}
+	return base + CountLess(keys + base, length, key);
+}
+
+inline int KeySearch(const int* keys, int size, int key, std::less<int> = {}) {
+	return VectorKeySearch(keys, size, key);
+}
+
+inline int KeySearch(const int64_t* keys, int size, int64_t key, std::less<int64_t> = {}) {
+	return VectorKeySearch(keys, size, key);
+}
+
+// The search for other keys and orders: a branchless binary search all the way down.
+template <typename Key, typename Compare>
+int KeySearch(const Key* keys, int size, const Key& key, Compare compare) {
+	int base = 0;
+	int length = size;
+	while (length > 1) {
+		int half = length / 2;
+		base = compare(keys[base + half - 1], key) ? base + half : base;
+		length -= half;
+	}
+	return base + (length == 1 && compare(keys[base], key) ? 1 : 0);
+}
+
+// A node and its arrays make one block: the node itself, then keys[2t - 1] (and KEY_LANES of padding),
+// values[2t - 1] and children[2t]. Keys are kept apart from the values, so the key search reads only keys.
+// The node knows nothing of t, the tree keeps the sizes within the capacity. Children are referred to
+// by ChildRef: by pointers in memory and by page IDs on disk. Keys and values are copied as they are, so they
+// must be trivially copyable.
+template <typename ChildRef, typename Key = int, typename Value = int>
+struct BasicBTreeNode {
+	static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+		"Nodes keep keys and values in raw arrays.");
+
+	using Child = ChildRef;
+	// Types of the elements of the arrays keys and values.
+	using KeySlot = Key;
+	using ValueSlot = Value;
+	using Pair = BasicKeyValuePair<Key, Value>;
+
+	template <typename Compare = std::less<Key>>
+	int Find(const Key& key, Compare compare = Compare()) const {
+		return KeySearch(keys, size, key, compare);
+	}
+
+	// Whether the key is at the index found for it by Find (or KeySearch).
+	template <typename Compare = std::less<Key>>
+	bool HasKeyAt(int index, const Key& key, Compare compare = Compare()) const {
+		return 0 <= index && index < size && !compare(key, keys[index]);
+	}
+
+	const Key& KeyAt(int index) const {
+		return keys[index];
+	}
+
+	Pair GetKeyValue(int index) const {
+		return { keys[index], values[index] };
+	}
+
+	void SetKeyValue(int index, const Pair& pair) {
+		keys[index] = pair.key;
+		values[index] = pair.value;
+	}
+
+	void AppendKeyValue(const Pair& pair) {
+		SetKeyValue(size++, pair);
+	}
+
+	// Inserts the child before the key that separates it is inserted, so the node has size + 1 children.
+	void InsertChild(int index, ChildRef child) {
+		std::copy_backward(children + index, children + size + 1, children + size + 2);
+		children[index] = child;
+	}
+
+	void InsertKeyValue(int index, const Pair& pair) {
+		std::copy_backward(keys + index, keys + size, keys + size + 1);
+		std::copy_backward(values + index, values + size, values + size + 1);
+		SetKeyValue(index, pair);
+		++size;
+	}
+
+	// Removes the child before the key that separated it is removed.
+	void RemoveChild(int index) {
+		std::copy(children + index + 1, children + size + 1, children + index);
+	}
+
+	void RemoveKeyValue(int index) {
+		std::copy(keys + index + 1, keys + size, keys + index);
+		std::copy(values + index + 1, values + size, values + index);
+		--size;
+	}
+
+	// Appends size_to_copy keys and values of the other node starting from its key `from`.
+	void AppendKeyValues(const BasicBTreeNode* other, int from, int size_to_copy) {
+		std::copy(other->keys + from, other->keys + from + size_to_copy, keys + size);
+		std::copy(other->values + from, other->values + from + size_to_copy, values + size);
+		size += size_to_copy;
+	}
+
+	// Keeps the first `new_size` keys.
+	void Truncate(int new_size) {
+		size = new_size;
+	}
+
+	// Rotation through this node: the key separating the child_index'th child from the previous sibling goes
+	// down to the child, and the last key of the sibling (with its last child) takes its place.
+	void TakeFromPrevious(int child_index, BasicBTreeNode* child, BasicBTreeNode* prev_sibling) {
+		if (!child->is_leaf) {
+			child->InsertChild(0, prev_sibling->children[prev_sibling->size]);
+		}
+		child->InsertKeyValue(0, GetKeyValue(child_index - 1));
+
+		SetKeyValue(child_index - 1, prev_sibling->GetKeyValue(prev_sibling->size - 1));
+
+		// Drops the last key (and the last child).
+		--prev_sibling->size;
+	}
+
+	void TakeFromNext(int child_index, BasicBTreeNode* child, BasicBTreeNode* next) {
+		if (!child->is_leaf) {
+			child->children[child->size + 1] = next->children[0];
+		}
+		child->SetKeyValue(child->size++, GetKeyValue(child_index));
+
+		SetKeyValue(child_index, next->GetKeyValue(0));
+
+		// Remove the first element.
+		if (!next->is_leaf) {
+			next->RemoveChild(0);
+		}
+		next->RemoveKeyValue(0);
+	}
+
+	bool is_leaf = true;
+	// Number of keys.
+	int size = 0;
+	Key* keys = nullptr;
+	Value* values = nullptr;
+	ChildRef* children = nullptr;
+};
+
+// A node of the trees kept in memory.
+template <typename Key = int, typename Value = int>
+struct BTreeNode : BasicBTreeNode<BTreeNode<Key, Value>*, Key, Value> {
+	using Base = BasicBTreeNode<BTreeNode*, Key, Value>;
+	using Pair = BasicKeyValuePair<Key, Value>;
+
+	Pair GetPredecessor(int index) const {
+		BTreeNode* current = this->children[index];
+		while (!current->is_leaf) {
+			current = current->children[current->size];
+		}
+		return current->GetKeyValue(current->size - 1);
+	}
+
+	Pair GetSuccessor(int index) const {
+		BTreeNode* current = this->children[index + 1];
+		while (!current->is_leaf) {
+			current = current->children[0];
+		}
+
+		return current->GetKeyValue(0);
+	}
+
+	void TakeFromPrevious(int child_index) {
+		Base::TakeFromPrevious(child_index, this->children[child_index], this->children[child_index - 1]);
+	}
+
+	void TakeFromNext(int child_index) {
+		Base::TakeFromNext(child_index, this->children[child_index], this->children[child_index + 1]);
+	}
+
+	// Neighbouring leaves of a B+ tree leaf in key order, null at the ends of the chain.
+	BTreeNode* prev = nullptr;
+	BTreeNode* next = nullptr;
+};
+
+// The first 8 bytes of the string (padded with zeros) as a big-endian number with the sign bit flipped, so that
+// the signed numbers of two strings compare as their first bytes do, and are searched as int64 keys.
+inline int64_t KeyHead(std::string_view bytes) {
+	uint64_t head = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		head = head << 8 | (i < bytes.size() ? static_cast<unsigned char>(bytes[i]) : 0u);
+	}
+	return static_cast<int64_t>(head ^ (uint64_t{ 1 } << 63));
+}
+
+// A node of BTree<std::string, Value>, with the operations of BTreeNode. The common prefix of the keys of the node
+// is kept once, and of each key only the rest of it, the suffix. The heads of the suffixes (see KeyHead) are kept
+// in keys[], so the search compares numbers, with the vector search of int64 keys, and reads suffixes only
+// when the heads are equal. Keys are ordered
+// bytewise, as std::string orders them. The prefix and the suffixes are kept on the heap, the rest as in
+// BasicBTreeNode.
+template <typename Value>
+struct StringBTreeNode {
+	static_assert(std::is_trivially_copyable<Value>::value, "Nodes keep values in raw arrays.");
+
+	using Child = StringBTreeNode*;
+	using KeySlot = int64_t;
+	using ValueSlot = Value;
+	using Pair = BasicKeyValuePair<std::string, Value>;
+
+	// Vector search by the heads, and binary search by the suffixes among equal heads.
+	int Find(const std::string& key, std::less<std::string> = {}) const {
+		int order = key.compare(0, prefix.size(), prefix);
+		if (order != 0) {
+			// The key is less or greater than all keys of the node.
+			return order < 0 ? 0 : size;
+		}
+		std::string_view rest = std::string_view(key).substr(prefix.size());
+		int64_t head = KeyHead(rest);
+		int begin = VectorKeySearch<int64_t>(keys, size, head);
+		if (begin == size || keys[begin] != head) {
+			return begin;
+		}
+		// Heads are mostly distinct, so the end of the equal ones is searched for only if there are two of them.
+		int end = begin + 1;
+		if (end < size && keys[end] == head) {
+			end = head == std::numeric_limits<int64_t>::max() ? size : VectorKeySearch<int64_t>(keys, size, head + 1);
+		}
+		auto less = [](const std::string& suffix, std::string_view key) { return std::string_view(suffix) < key; };
+		return static_cast<int>(std::lower_bound(suffixes.begin() + begin, suffixes.begin() + end, rest, less)
+			- suffixes.begin());
+	}
+
+	bool HasKeyAt(int index, const std::string& key, std::less<std::string> = {}) const {
+		return 0 <= index && index < size && key.size() == prefix.size() + suffixes[index].size()
+			&& key.compare(0, prefix.size(), prefix) == 0 && key.compare(prefix.size(), std::string::npos, suffixes[index]) == 0;
+	}
+
+	std::string KeyAt(int index) const {
+		return prefix + suffixes[index];
+	}
+
+	Pair GetKeyValue(int index) const {
+		return { KeyAt(index), values[index] };
+	}
+
+	void SetKeyValue(int index, const Pair& pair) {
+		if (size == 1) {
+			// The only key is all prefix.
+			prefix = pair.key;
+		} else {
+			size_t common = 0;
+			while (common < prefix.size() && common < pair.key.size() && prefix[common] == pair.key[common]) {
+				++common;
+			}
+			ShortenPrefix(common);
+		}
+		suffixes[index].assign(pair.key, prefix.size(), std::string::npos);
+		keys[index] = KeyHead(suffixes[index]);
+		values[index] = pair.value;
+	}
+
+	void AppendKeyValue(const Pair& pair) {
+		suffixes.emplace_back();
+		++size;
+		SetKeyValue(size - 1, pair);
+	}
+
+	void InsertChild(int index, StringBTreeNode* child) {
+		std::copy_backward(children + index, children + size + 1, children + size + 2);
+		children[index] = child;
+	}
+
+	void InsertKeyValue(int index, const Pair& pair) {
+		std::copy_backward(keys + index, keys + size, keys + size + 1);
+		std::copy_backward(values + index, values + size, values + size + 1);
+		suffixes.emplace(suffixes.begin() + index);
+		++size;
+		SetKeyValue(index, pair);
+	}
+
+	void RemoveChild(int index) {
+		std::copy(children + index + 1, children + size + 1, children + index);
+	}
+
+	// Removing the first or the last key may lengthen the common prefix.
+	void RemoveKeyValue(int index) {
+		std::copy(keys + index + 1, keys + size, keys + index);
+		std::copy(values + index + 1, values + size, values + index);
+		suffixes.erase(suffixes.begin() + index);
+		--size;
+		if (index == 0 || index == size) {
+			LengthenPrefix();
+		}
+	}
+
+	void AppendKeyValues(const StringBTreeNode* other, int from, int size_to_copy) {
+		for (int i = from; i < from + size_to_copy; ++i) {
+			AppendKeyValue(other->GetKeyValue(i));
+		}
+	}
+
+	void Truncate(int new_size) {
+		size = new_size;
+		suffixes.resize(size);
+		LengthenPrefix();
+	}
+
+	Pair GetPredecessor(int index) const {
+		StringBTreeNode* current = children[index];
+		while (!current->is_leaf) {
+			current = current->children[current->size];
+		}
+		return current->GetKeyValue(current->size - 1);
+	}
+
+	Pair GetSuccessor(int index) const {
+		StringBTreeNode* current = children[index + 1];
+		while (!current->is_leaf) {
+			current = current->children[0];
+		}
+		return current->GetKeyValue(0);
+	}
+
+	void TakeFromPrevious(int child_index) {
+		StringBTreeNode* child = children[child_index];
+		StringBTreeNode* prev_sibling = children[child_index - 1];
+		if (!child->is_leaf) {
+			child->InsertChild(0, prev_sibling->children[prev_sibling->size]);
+		}
+		child->InsertKeyValue(0, GetKeyValue(child_index - 1));
+		SetKeyValue(child_index - 1, prev_sibling->GetKeyValue(prev_sibling->size - 1));
+		prev_sibling->Truncate(prev_sibling->size - 1);
+	}
+
+	void TakeFromNext(int child_index) {
+		StringBTreeNode* child = children[child_index];
+		StringBTreeNode* next = children[child_index + 1];
+		if (!child->is_leaf) {
+			child->children[child->size + 1] = next->children[0];
+		}
+		child->AppendKeyValue(GetKeyValue(child_index));
+		SetKeyValue(child_index, next->GetKeyValue(0));
+		if (!next->is_leaf) {
+			next->RemoveChild(0);
+		}
+		next->RemoveKeyValue(0);
+	}
+
+	bool is_leaf = true;
+	// Number of keys.
+	int size = 0;
+	// Heads of the suffixes.
+	int64_t* keys = nullptr;
+	Value* values = nullptr;
+	StringBTreeNode** children = nullptr;
+	std::string prefix;
+	std::vector<std::string> suffixes;
+
+private:
+	// Moves the end of the prefix past the given length back into the suffixes.
+	void ShortenPrefix(size_t length) {
+		if (length == prefix.size()) {
+			return;
+		}
+		for (int i = 0; i < size; ++i) {
+			suffixes[i].insert(0, prefix, length, std::string::npos);
+			keys[i] = KeyHead(suffixes[i]);
+		}
+		prefix.resize(length);
+	}
+
+	// Moves the common beginning of the suffixes into the prefix. The keys are sorted, so it is the common
+	// beginning of the first and the last suffix.
+	void LengthenPrefix() {
+		if (size == 0) {
+			return;
+		}
+		const std::string& first = suffixes[0];
+		const std::string& last = suffixes[size - 1];
+		size_t common = 0;
+		while (common < first.size() && common < last.size() && first[common] == last[common]) {
+			++common;
+		}
+		if (common == 0) {
+			return;
+		}
+		prefix.append(first, 0, common);
+		for (int i = 0; i < size; ++i) {
+			suffixes[i].erase(0, common);
+			keys[i] = KeyHead(suffixes[i]);
+		}
+	}
+};
+
+// The node type of BTree<Key, Value>: string keys are kept prefix-compressed.
+template <typename Key, typename Value>
+struct BTreeNodeFor {
+	using Type = BTreeNode<Key, Value>;
+};
+
+template <typename Value>
+struct BTreeNodeFor<std::string, Value> {
+	using Type = StringBTreeNode<Value>;
+};
+
+inline size_t RoundUp(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+// Offsets of the arrays of a node in its block for the given t. The block size is rounded up to the alignment.
+template <typename Node>
+struct NodeLayout {
+	NodeLayout(int min_branching_degree, size_t alignment)
+		: keys_offset(RoundUp(sizeof(Node), alignof(typename Node::KeySlot))),
+		values_offset(RoundUp(keys_offset + (2 * min_branching_degree - 1 + KEY_LANES) * sizeof(typename Node::KeySlot),
+			alignof(typename Node::ValueSlot))),
+		children_offset(RoundUp(values_offset + (2 * min_branching_degree - 1) * sizeof(typename Node::ValueSlot),
+			alignof(typename Node::Child))),
+		size(RoundUp(children_offset + 2 * min_branching_degree * sizeof(typename Node::Child), alignment)) {}
+
+	// Points the arrays of the node at the start of the block at their places in it.
+	Node* Bind(char* block) const {
+		Node* node = reinterpret_cast<Node*>(block);
+		node->keys = reinterpret_cast<typename Node::KeySlot*>(block + keys_offset);
+		node->values = reinterpret_cast<typename Node::ValueSlot*>(block + values_offset);
+		node->children = reinterpret_cast<typename Node::Child*>(block + children_offset);
+		return node;
+	}
+
+	size_t keys_offset;
+	size_t values_offset;
+	size_t children_offset;
+	size_t size;
+};
+
+// Allocates nodes from large slabs, so that the nodes lie close together and the tree does not fragment
+// the heap. Nodes freed by merges are reused; all of them are freed at once with the pool (the nodes with
+// something to destroy must be destroyed by the tree before that).
+template <typename Node>
+class BasicNodePool {
+public:
+	static constexpr size_t CACHE_LINE{ 64 };
+	static constexpr size_t SLAB_SIZE{ 1 << 16 };
+
+	explicit BasicNodePool(int min_branching_degree)
+		: layout_(min_branching_degree, CACHE_LINE),
+		nodes_per_slab_(std::max<size_t>(16, SLAB_SIZE / layout_.size)), used_in_slab_(nodes_per_slab_) {}
+
+	BasicNodePool(const BasicNodePool&) = delete;
+	BasicNodePool& operator=(const BasicNodePool&) = delete;
+
+	Node* Allocate(bool is_leaf) {
+		char* block;
+		if (free_list_ != nullptr) {
+			block = free_list_;
+			free_list_ = *reinterpret_cast<char**>(block);
+		} else {
+			if (used_in_slab_ == nodes_per_slab_) {
+				slabs_.emplace_back(new char[nodes_per_slab_ * layout_.size + CACHE_LINE]);
+				used_in_slab_ = 0;
+			}
+			block = AlignToCacheLine(slabs_.back().get()) + used_in_slab_++ * layout_.size;
+		}
+		Node* node = layout_.Bind(reinterpret_cast<char*>(new (block) Node()));
+		node->is_leaf = is_leaf;
+		return node;
+	}
+
+	void Free(Node* node) {
+		node->~Node();
+		char* block = reinterpret_cast<char*>(node);
+		*reinterpret_cast<char**>(block) = free_list_;
+		free_list_ = block;
+	}
+
+	// Frees all nodes.
+	void Clear() {
+		slabs_.clear();
+		used_in_slab_ = nodes_per_slab_;
+		free_list_ = nullptr;
+	}
+
+private:
+	NodeLayout<Node> layout_;
+	size_t nodes_per_slab_;
+	size_t used_in_slab_;
+	std::vector<std::unique_ptr<char[]>> slabs_;
+	// Freed blocks, each holding a pointer to the next one.
+	char* free_list_ = nullptr;
+
+	static char* AlignToCacheLine(char* pointer) {
+		return pointer + (CACHE_LINE - reinterpret_cast<uintptr_t>(pointer) % CACHE_LINE) % CACHE_LINE;
+	}
+};
+
+using BTreeNodePool = BasicNodePool<BTreeNode<>>;
+
+// Sorts the pairs to load by key (unless they are sorted already) and keeps the first of the pairs with equal
+// keys, as Insert would do.
+template <typename Pair, typename Compare = std::less<decltype(Pair::key)>>
+void PrepareToLoad(std::vector<Pair>& pairs, Compare compare = Compare()) {
+	auto by_key = [&compare](const Pair& left, const Pair& right) { return compare(left.key, right.key); };
+	if (!std::is_sorted(pairs.begin(), pairs.end(), by_key)) {
+		std::stable_sort(pairs.begin(), pairs.end(), by_key);
+	}
+	// Of two sorted keys the first one is not less than the second only if they are equal.
+	pairs.erase(std::unique(pairs.begin(), pairs.end(),
+		[&compare](const Pair& left, const Pair& right) { return !compare(left.key, right.key); }), pairs.end());
+}
+
+// Number of keys a bulk loaded node gets: about fill_factor * (2t - 1), but no less than t - 1.
+inline size_t LoadedNodeSize(int min_branching_degree, double fill_factor) {
+	const size_t max_size = 2 * min_branching_degree - 1;
+	return std::max<size_t>(min_branching_degree - 1, std::min(max_size, static_cast<size_t>(fill_factor * max_size)));
+}
+
+// Makes a node of `size` pairs starting from pairs[begin] and, unless it is a leaf, of the children between them.
+template <typename Node, typename Pair>
+Node* MakeNode(BasicNodePool<Node>& pool, const std::vector<Pair>& pairs,
+	const std::vector<Node*>& children, size_t begin, size_t size) {
+	Node* node = pool.Allocate(children.empty());
+	for (size_t i = begin; i < begin + size; ++i) {
+		node->AppendKeyValue(pairs[i]);
+	}
+	if (!children.empty()) {
+		std::copy(children.begin() + begin, children.begin() + (begin + size + 1), node->children);
+	}
+	return node;
+}
+
+// MakeNode for BuildLevels.
+template <typename Node>
+auto MakeNodeIn(BasicNodePool<Node>& pool) {
+	return [&pool](const auto& pairs, const std::vector<Node*>& children, size_t begin, size_t size) {
+		return MakeNode(pool, pairs, children, begin, size);
+	};
+}
+
+// Builds a tree bottom-up, a level at a time, from the sorted keys of the lowest level and returns its root.
+// Without children the pairs make the leaves; otherwise pairs[i] separates children[i] and children[i + 1].
+// Nodes are made by make_node(pairs, children, begin, size), as MakeNode does.
+template <typename NodeRef, typename Pair, typename MakeNodeFunction>
+NodeRef BuildLevels(std::vector<Pair> pairs, std::vector<NodeRef> children, int min_branching_degree,
+	size_t node_size, MakeNodeFunction make_node) {
+	const size_t max_size = 2 * min_branching_degree - 1;
+	while (pairs.size() > max_size) {
+		// Splitting the level into nodes; a key between two nodes goes one level up. The number of nodes
+		// is chosen so that each gets from t - 1 to 2t - 1 keys, as close to node_size as possible.
+		size_t num_of_nodes = (pairs.size() + 1 + node_size) / (node_size + 1);
+		num_of_nodes = std::min(num_of_nodes, (pairs.size() + 1) / min_branching_degree);
+		size_t num_of_node_keys = pairs.size() - (num_of_nodes - 1);
+		std::vector<Pair> separators;
+		separators.reserve(num_of_nodes - 1);
+		std::vector<NodeRef> nodes;
+		nodes.reserve(num_of_nodes);
+		size_t begin = 0;
+		for (size_t j = 0; j < num_of_nodes; ++j) {
+			size_t size = num_of_node_keys * (j + 1) / num_of_nodes - num_of_node_keys * j / num_of_nodes;
+			nodes.push_back(make_node(pairs, children, begin, size));
+			begin += size;
+			if (j + 1 < num_of_nodes) {
+				separators.push_back(pairs[begin++]);
+			}
+		}
+		pairs.swap(separators);
+		children.swap(nodes);
+	}
+	return make_node(pairs, children, 0, pairs.size());
+}
+
+// Spreads the sorted pairs evenly over the leaves of a B+ tree and chains the leaves by `next`. Each leaf gets
+// about node_size pairs, but no less than t - 1 (unless it is the only one). The first keys of the leaves
+// but the first one are put into separators.
+template <typename Node>
+std::vector<Node*> MakeLeaves(BasicNodePool<Node>& pool, const std::vector<KeyValuePair>& pairs,
+	int min_branching_degree, size_t node_size, std::vector<KeyValuePair>& separators) {
+	size_t num_of_leaves = (pairs.size() + node_size - 1) / node_size;
+	num_of_leaves = std::max<size_t>(1, std::min(num_of_leaves, pairs.size() / (min_branching_degree - 1)));
+	separators.clear();
+	separators.reserve(num_of_leaves - 1);
+	std::vector<Node*> leaves;
+	leaves.reserve(num_of_leaves);
+	size_t begin = 0;
+	for (size_t j = 0; j < num_of_leaves; ++j) {
+		size_t size = pairs.size() * (j + 1) / num_of_leaves - pairs.size() * j / num_of_leaves;
+		Node* leaf = MakeNode<Node>(pool, pairs, {}, begin, size);
+		if (j != 0) {
+			separators.push_back(pairs[begin]);
+			leaves.back()->next = leaf;
+		}
+		leaves.push_back(leaf);
+		begin += size;
+	}
+	return leaves;
+}
+
+// The child of an internal node of a B+ tree whose subtree may hold the key. Keys equal to a separator go right.
+template <typename Node>
+int BPlusChildIndex(const Node* node, int key) {
+	int i = KeySearch(node->keys, node->size, key);
+	return node->HasKeyAt(i, key) ? i + 1 : i;
+}
+
+// Counts of the structural changes of a BTree and of the nodes its operations visit.
+struct BTreeCounters {
+	uint64_t splits = 0;
+	uint64_t merges = 0;
+	// Keys taken by a child from a sibling through the parent (TakeFromPrevious and TakeFromNext).
+	uint64_t borrows = 0;
+	// Searches, inserts, removals and ranges; a VisitSorted counts as one operation per key.
+	uint64_t operations = 0;
+	uint64_t nodes_visited = 0;
+};
+
+struct BTreeShape {
+	// A lone leaf has height 1.
+	int height = 0;
+	size_t num_of_nodes = 0;
+	size_t num_of_keys = 0;
+	// Share of the capacity of the nodes (2t - 1 keys each) that is used.
+	double average_fill = 0;
+};
+
+// Keys are ordered by Compare. Keys and values other than strings must be trivially copyable; string keys are
+// ordered bytewise and kept prefix-compressed (see StringBTreeNode).
+template <typename Key = int, typename Value = int, typename Compare = std::less<Key>>
+class BTree {
+public:
+	using KeyType = Key;
+	using ValueType = Value;
+	using Node = typename BTreeNodeFor<Key, Value>::Type;
+	using Pair = BasicKeyValuePair<Key, Value>;
+	using Response = BasicSearchResponse<Value>;
+
+	explicit BTree(int min_branching_degree, Compare compare = Compare())
+		: min_branching_degree_(min_branching_degree), compare_(compare), pool_(min_branching_degree),
+		root_(pool_.Allocate(true)) {}
+
+	BTree(const BTree&) = delete;
+	BTree& operator=(const BTree&) = delete;
+
+	~BTree() {
+		Destroy(root_);
+	}
+
+	// Inserts the given key-value pair into the tree. If the key already present, returns false and does nothing.
+	bool Insert(const Key& key, const Value& value) {
+		++counters_.operations;
+		if (Search(root_, key).is_found) {
+			return false;
+		}
+
+		Node* root = root_;
+		if (root_->size == (2 * min_branching_degree_ - 1)) {
+			Node* new_root = pool_.Allocate(false);
+			root_ = new_root;
+			new_root->children[0] = root;
+			SplitChild(new_root, 0);
+			InsertNonFull(new_root, key, value);
+		} else {
+			InsertNonFull(root, key, value);
+		}
+
+		return true;
+	}
+
+	Response Search(const Key& key) const {
+		++counters_.operations;
+		return Search(root_, key);
+	}
+
+	// Replaces the contents of the tree with the given pairs. The tree is built bottom-up, a level at a time,
+	// in linear time once the pairs are sorted (they are sorted here unless they already are). Of the pairs
+	// with equal keys the first one is kept, as Insert would do. Every node gets about fill_factor * (2t - 1)
+	// keys, but no less than t - 1.
+	void BulkLoad(std::vector<Pair> pairs, double fill_factor = 1.0) {
+		PrepareToLoad(pairs, compare_);
+		Destroy(root_);
+		pool_.Clear();
+		root_ = BuildLevels<Node*>(std::move(pairs), {}, min_branching_degree_,
+			LoadedNodeSize(min_branching_degree_, fill_factor), MakeNodeIn(pool_));
+	}
+
+	Response Remove(const Key& key) {
+		++counters_.operations;
+		auto res = Remove(root_, key);
+		if (root_->size == 0 && !root_->is_leaf) {
+			Node* tmp = root_;
+			root_ = root_->children[0];
+			pool_.Free(tmp);
+		}
+		return res;
+	}
+
+	// Calls visit(pair) for the pairs with keys from lo to hi, in key order. Subtrees out of the range are skipped.
+	template <typename Visit>
+	void Range(const Key& lo, const Key& hi, Visit visit) const {
+		++counters_.operations;
+		Range(root_, lo, hi, visit);
+	}
+
+	// Looks up the n distinct sorted keys at once, going down into each subtree once for all its keys, and calls
+	// visit(i, value) for each of them: value points at the value of keys[i] in the tree, or is null if there is
+	// no such key. The value may be changed in place; the tree must not be changed till the end.
+	template <typename Visit>
+	void VisitSorted(const Key* keys, size_t n, Visit visit) {
+		counters_.operations += n;
+		VisitSorted(root_, keys, 0, n, visit);
+	}
+
+	// Inserts the pairs with the n distinct sorted keys, as Insert does each of them, going down into each subtree
+	// once for all the pairs it takes. Full children on the way are split; when a node is full itself, the pairs
+	// left go down again from its parent.
+	void InsertSorted(const Pair* pairs, size_t n) {
+		counters_.operations += n;
+		for (size_t begin = 0; begin < n; ) {
+			if (root_->size == (2 * min_branching_degree_ - 1)) {
+				Node* new_root = pool_.Allocate(false);
+				new_root->children[0] = root_;
+				root_ = new_root;
+				SplitChild(new_root, 0);
+			}
+			begin = InsertSorted(root_, pairs, begin, n);
+		}
+	}
+
+	// Removes the n distinct sorted keys, as Remove does each of them, going down into each subtree once for all
+	// the keys it loses. Children on the way are filled up to t keys; when a node is down to t - 1 keys itself,
+	// the keys left go down again from its parent.
+	void RemoveSorted(const Key* keys, size_t n) {
+		counters_.operations += n;
+		for (size_t begin = 0; begin < n; ) {
+			begin = RemoveSorted(root_, keys, begin, n);
+			if (root_->size == 0 && !root_->is_leaf) {
+				Node* tmp = root_;
+				root_ = root_->children[0];
+				pool_.Free(tmp);
+			}
+		}
+	}
+
+	const BTreeCounters& GetCounters() const {
+		return counters_;
+	}
+
+	void ResetCounters() {
+		counters_ = BTreeCounters();
+	}
+
+	// Walks the whole tree.
+	BTreeShape GetShape() const {
+		BTreeShape shape;
+		AddToShape(root_, 1, shape);
+		shape.average_fill = static_cast<double>(shape.num_of_keys) / (shape.num_of_nodes * (2 * min_branching_degree_ - 1));
+		return shape;
+	}
+
+private:
+	int min_branching_degree_;
+	Compare compare_;
+	BasicNodePool<Node> pool_;
+	Node* root_;
+	mutable BTreeCounters counters_;
+
+	static void AddToShape(const Node* node, int depth, BTreeShape& shape) {
+		shape.height = std::max(shape.height, depth);
+		++shape.num_of_nodes;
+		shape.num_of_keys += node->size;
+		if (!node->is_leaf) {
+			for (int i = 0; i <= node->size; ++i) {
+				AddToShape(node->children[i], depth + 1, shape);
+			}
+		}
+	}
+
+	// Destroys the nodes of the subtree, if they have anything to destroy; the pool only frees their memory.
+	static void Destroy(Node* node) {
+		if constexpr (!std::is_trivially_destructible<Node>::value) {
+			if (!node->is_leaf) {
+				for (int i = 0; i <= node->size; ++i) {
+					Destroy(node->children[i]);
+				}
+			}
+			node->~Node();
+		}
+	}
+
+	// Inserts key-value in the non-full node.
+	void InsertNonFull(Node* node, const Key& key, const Value& value) {
+		++counters_.nodes_visited;
+		int i = node->Find(key, compare_);
+		if (node->is_leaf) {
+			node->InsertKeyValue(i, { key, value });
+			// DISK WRITE node
+		} else {
+			// DISK READ node.children[i]
+			if (node->children[i]->size == (2 * min_branching_degree_ - 1)) {
+				SplitChild(node, i);
+				if (compare_(node->KeyAt(i), key)) {
+					++i;
+				}
+			}
+			InsertNonFull(node->children[i], key, value);
+		}
+	}
+
+	// Searches for the key in the given node.
+	Response Search(const Node* node, const Key& key) const {
+		++counters_.nodes_visited;
+		int key_pos = node->Find(key, compare_);
+		// If we found the key.
+		if (node->HasKeyAt(key_pos, key, compare_)) {
+			return Response{ true, node->values[key_pos] };
+		} else if (node->is_leaf) {
+			return Response{ false, Value() };
+		} else {
+			return Search(node->children[key_pos], key);
+		}
+	}
+
+	template <typename Visit>
+	void Range(const Node* node, const Key& lo, const Key& hi, Visit& visit) const {
+		++counters_.nodes_visited;
+		// The child before a key holds the keys less than it, so it is visited even if the key is past hi.
+		for (int i = node->Find(lo, compare_); ; ++i) {
+			if (!node->is_leaf) {
+				Range(node->children[i], lo, hi, visit);
+			}
+			if (i == node->size || compare_(hi, node->KeyAt(i))) {
+				return;
+			}
+			visit(node->GetKeyValue(i));
+		}
+	}
+
+	template <typename Visit>
+	void VisitSorted(Node* node, const Key* keys, size_t begin, size_t end, Visit& visit) {
+		++counters_.nodes_visited;
+		while (begin < end) {
+			int key_pos = node->Find(keys[begin], compare_);
+			if (node->HasKeyAt(key_pos, keys[begin], compare_)) {
+				visit(begin++, &node->values[key_pos]);
+			} else if (node->is_leaf) {
+				visit(begin++, nullptr);
+			} else {
+				// The keys less than the key at key_pos go down to the same child.
+				size_t child_end = key_pos == node->size ? end
+					: std::lower_bound(keys + begin, keys + end, node->KeyAt(key_pos), compare_) - keys;
+				VisitSorted(node->children[key_pos], keys, begin, child_end, visit);
+				begin = child_end;
+			}
+		}
+	}
+
+	// Inserts pairs[begin], pairs[begin + 1], ... into the subtree of the non-full node till a pair does not fit
+	// without splitting the node, and returns the index of that pair (end if all of them are inserted).
+	size_t InsertSorted(Node* node, const Pair* pairs, size_t begin, size_t end) {
+		++counters_.nodes_visited;
+		const int max_size = 2 * min_branching_degree_ - 1;
+		while (begin < end) {
+			int key_pos = node->Find(pairs[begin].key, compare_);
+			if (node->HasKeyAt(key_pos, pairs[begin].key, compare_)) {
+				++begin;
+			} else if (node->is_leaf) {
+				if (node->size == max_size) {
+					break;
+				}
+				node->InsertKeyValue(key_pos, pairs[begin++]);
+				// DISK WRITE node
+			} else if (node->children[key_pos]->size == max_size) {
+				if (node->size == max_size) {
+					break;
+				}
+				SplitChild(node, key_pos);
+			} else {
+				// The pairs less than the key at key_pos go down to the same child.
+				size_t child_end = key_pos == node->size ? end
+					: std::lower_bound(pairs + begin, pairs + end, node->KeyAt(key_pos),
+						[this](const Pair& pair, const Key& key) { return compare_(pair.key, key); }) - pairs;
+				begin = InsertSorted(node->children[key_pos], pairs, begin, child_end);
+			}
+		}
+		return begin;
+	}
+
+	// Removes keys[begin], keys[begin + 1], ... from the subtree of the node, which holds at least t keys
+	// unless it is the root, while it can lose a key, and returns the index of the first key left.
+	size_t RemoveSorted(Node* node, const Key* keys, size_t begin, size_t end) {
+		++counters_.nodes_visited;
+		while (begin < end && CanLoseKey(node)) {
+			int key_pos = node->Find(keys[begin], compare_);
+			if (node->HasKeyAt(key_pos, keys[begin], compare_)) {
+				if (node->is_leaf) {
+					RemoveFromLeaf(node, key_pos);
+				} else {
+					RemoveFromNonLeaf(node, key_pos);
+				}
+				++begin;
+			} else if (node->is_leaf) {
+				++begin;
+			} else if (node->children[key_pos]->size < min_branching_degree_) {
+				Fill(node, key_pos);
+			} else {
+				// The keys less than the key at key_pos go down to the same child.
+				size_t child_end = key_pos == node->size ? end
+					: std::lower_bound(keys + begin, keys + end, node->KeyAt(key_pos), compare_) - keys;
+				begin = RemoveSorted(node->children[key_pos], keys, begin, child_end);
+			}
+		}
+		return begin;
+	}
+
+	// Removes the given key from the node or its descendant.
+	Response Remove(Node* node, const Key& key) {
+		++counters_.nodes_visited;
+		int key_pos = node->Find(key, compare_);
+		// If we have such a key in this node, we can delete it.
+		if (node->HasKeyAt(key_pos, key, compare_)) {
+			Value value = node->values[key_pos];
+			if (node->is_leaf) {
+				RemoveFromLeaf(node, key_pos);
+			} else {
+				RemoveFromNonLeaf(node, key_pos);
+			}
+			return { true, value };
+		} else {
+			// If it is a leaf, there are no descendants.
+			if (node->is_leaf) {
+				return { false, Value() };
+			}
+
+			// Else we are going to look in descendants.
+			bool was_last = key_pos == node->size;
+
+			if (node->children[key_pos]->size < min_branching_degree_) {
+				Fill(node, key_pos);
+			}
+
+			if (was_last && key_pos > node->size) {
+				return Remove(node->children[key_pos - 1], key);
+			}
+			return Remove(node->children[key_pos], key);
+		}
+	}
+
+	// Removes the given key from the node which happened to be a leaf.
+	static void RemoveFromLeaf(Node* node, int index) {
+		node->RemoveKeyValue(index);
+	}
+
+	// Removes the given key from non-leaf node.
+	void RemoveFromNonLeaf(Node* node, int index) {
+		if (CanTakeFrom(node->children[index])) {
+			auto pred = node->GetPredecessor(index);
+			node->SetKeyValue(index, pred);
+			Remove(node->children[index], pred.key);
+		} else if (CanTakeFrom(node->children[index + 1])) {
+			auto succ = node->GetSuccessor(index);
+			node->SetKeyValue(index, succ);
+			Remove(node->children[index + 1], succ.key);
+		} else {
+			Key key = node->KeyAt(index);
+			Merge(node, index);
+			Remove(node->children[index], key);
+		}
+	}
+
+	// Splitting the child_id'th child of the node into two parts.
+	void SplitChild(Node* node, int child_id) {
+		++counters_.splits;
+		Node* left = node->children[child_id];
+		int center_key_id = left->size / 2;
+		Node* right = pool_.Allocate(left->is_leaf);
+
+		// Taking second half of the keys.
+		right->AppendKeyValues(left, center_key_id + 1, left->size - (center_key_id + 1));
+		if (!left->is_leaf) {
+			std::copy(left->children + (center_key_id + 1), left->children + (left->size + 1), right->children);
+		}
+
+		node->InsertChild(child_id + 1, right);
+		node->InsertKeyValue(child_id, left->GetKeyValue(center_key_id));
+
+		left->Truncate(center_key_id);
+	}
+
+	// Merges the [index]'th and [index + 1]'th children of the node.
+	void Merge(Node* node, int index) {
+		++counters_.merges;
+		Node* child = node->children[index];
+		Node* sibling = node->children[index + 1];
+
+		child->AppendKeyValue(node->GetKeyValue(index));
+
+		// Adding all sibling's payload to the child.
+		if (!child->is_leaf) {
+			std::copy(sibling->children, sibling->children + (sibling->size + 1), child->children + child->size);
+		}
+		child->AppendKeyValues(sibling, 0, sibling->size);
+
+		node->RemoveChild(index + 1);
+		node->RemoveKeyValue(index);
+
+		pool_.Free(sibling);
+	}
+
+	void Fill(Node* node, int index) {
+		if (index != 0 && CanTakeFrom(node->children[index - 1])) {
+			node->TakeFromPrevious(index);
+			++counters_.borrows;
+		} else if (index != node->size && CanTakeFrom(node->children[index + 1])) {
+			node->TakeFromNext(index);
+			++counters_.borrows;
+		} else {
+			if (index != node->size) {
+				Merge(node, index);
+			} else {
+				Merge(node, index - 1);
+			}
+		}
+	}
+
+	// Indicates whether we can take payload from the node: it keeps at least t - 1 keys. A merge of two nodes
+	// that cannot lend (t - 1 keys each) and their separator fits into 2t - 1 keys.
+	bool CanTakeFrom(const Node* node) const {
+		return node->size >= min_branching_degree_;
+	}
+
+	// Indicates whether a key may be removed from the node or merged down from it: a node other than the root
+	// keeps at least t - 1 keys, and an internal root that has no keys left is to be replaced by its child.
+	bool CanLoseKey(const Node* node) const {
+		return node == root_ ? node->size > 0 || node->is_leaf : node->size >= min_branching_degree_;
+	}
+};
+
+// B+ tree: the pairs are kept only in the leaves, and the keys of the internal nodes just route the search
+// (keys[i] is the least key of children[i + 1] at the time it was set). The leaves are linked into a chain in
+// key order, so a range is read by walking the chain from its first key, with a single descent.
+class BPlusTree {
+public:
+	using KeyType = int;
+	using Node = BTreeNode<>;
+
+	// Bidirectional iterator over the pairs in key order. Any change of the tree invalidates it.
+	class Iterator {
+	public:
+		KeyValuePair operator*() const {
+			return leaf_->GetKeyValue(index_);
+		}
+
+		Iterator& operator++() {
+			// The end is the position past the last key of the last leaf.
+			if (++index_ == leaf_->size && leaf_->next != nullptr) {
+				leaf_ = leaf_->next;
+				index_ = 0;
+			}
+			return *this;
+		}
+
+		Iterator& operator--() {
+			if (index_ == 0) {
+				leaf_ = leaf_->prev;
+				index_ = leaf_->size;
+			}
+			--index_;
+			return *this;
+		}
+
+		bool operator==(const Iterator& other) const {
+			return leaf_ == other.leaf_ && index_ == other.index_;
+		}
+
+		bool operator!=(const Iterator& other) const {
+			return !(*this == other);
+		}
+
+	private:
+		friend class BPlusTree;
+
+		const Node* leaf_;
+		int index_;
+
+		Iterator(const Node* leaf, int index) : leaf_(leaf), index_(index) {}
+	};
+
+	explicit BPlusTree(int min_branching_degree)
+		: min_branching_degree_(min_branching_degree), pool_(min_branching_degree), root_(pool_.Allocate(true)),
+		head_(root_), tail_(root_) {}
+
+	// Inserts the given key-value pair into the tree. If the key already present, returns false and does nothing.
+	bool Insert(int key, int value) {
+		if (Search(key).is_found) {
+			return false;
+		}
+
+		if (root_->size == (2 * min_branching_degree_ - 1)) {
+			Node* new_root = pool_.Allocate(false);
+			new_root->children[0] = root_;
+			root_ = new_root;
+			SplitChild(new_root, 0);
+		}
+		Node* node = root_;
+		while (!node->is_leaf) {
+			int i = BPlusChildIndex(node, key);
+			if (node->children[i]->size == (2 * min_branching_degree_ - 1)) {
+				SplitChild(node, i);
+				if (key >= node->keys[i]) {
+					++i;
+				}
+			}
+			node = node->children[i];
+		}
+		node->InsertKeyValue(KeySearch(node->keys, node->size, key), { key, value });
+
+		return true;
+	}
+
+	SearchResponse Search(int key) const {
+		const Node* leaf = FindLeaf(key);
+		int key_pos = KeySearch(leaf->keys, leaf->size, key);
+		if (leaf->HasKeyAt(key_pos, key)) {
+			return SearchResponse{ true, leaf->values[key_pos] };
+		}
+		return SearchResponse{ false, 0 };
+	}
+
+	// Replaces the contents of the tree with the given pairs, as BTree::BulkLoad does. The pairs are spread
+	// evenly over the leaves, and the first keys of the leaves make the level above.
+	void BulkLoad(std::vector<KeyValuePair> pairs, double fill_factor = 1.0) {
+		PrepareToLoad(pairs);
+		pool_.Clear();
+		const size_t node_size = LoadedNodeSize(min_branching_degree_, fill_factor);
+		std::vector<KeyValuePair> separators;
+		std::vector<Node*> leaves = MakeLeaves(pool_, pairs, min_branching_degree_, node_size, separators);
+		for (size_t j = 1; j < leaves.size(); ++j) {
+			leaves[j]->prev = leaves[j - 1];
+		}
+		head_ = leaves.front();
+		tail_ = leaves.back();
+		root_ = leaves.size() == 1 ? head_
+			: BuildLevels<Node*>(std::move(separators), std::move(leaves), min_branching_degree_, node_size, MakeNodeIn(pool_));
+	}
+
+	SearchResponse Remove(int key) {
+		// Going down, every node is made to hold at least t keys first, so it stays valid after losing one.
+		Node* node = root_;
+		while (!node->is_leaf) {
+			int i = BPlusChildIndex(node, key);
+			if (node->children[i]->size < min_branching_degree_) {
+				i = Fill(node, i);
+			}
+			node = node->children[i];
+		}
+		if (root_->size == 0 && !root_->is_leaf) {
+			Node* tmp = root_;
+			root_ = root_->children[0];
+			pool_.Free(tmp);
+		}
+
+		int key_pos = KeySearch(node->keys, node->size, key);
+		if (!node->HasKeyAt(key_pos, key)) {
+			return { false, 0 };
+		}
+		int value = node->values[key_pos];
+		node->RemoveKeyValue(key_pos);
+		return { true, value };
+	}
+
+	Iterator Begin() const {
+		return Iterator(head_, 0);
+	}
+
+	Iterator End() const {
+		return Iterator(tail_, tail_->size);
+	}
+
+	// The position of the first pair with a key not less than the given one.
+	Iterator LowerBound(int key) const {
+		const Node* leaf = FindLeaf(key);
+		int key_pos = KeySearch(leaf->keys, leaf->size, key);
+		if (key_pos == leaf->size && leaf->next != nullptr) {
+			return Iterator(leaf->next, 0);
+		}
+		return Iterator(leaf, key_pos);
+	}
+
+	// Calls visit(pair) for the pairs with keys from lo to hi, in key order.
+	template <typename Visit>
+	void Range(int lo, int hi, Visit visit) const {
+		for (Iterator it = LowerBound(lo), end = End(); it != end; ++it) {
+			KeyValuePair pair = *it;
+			if (pair.key > hi) {
+				break;
+			}
+			visit(pair);
+		}
+	}
+
+	// Looks up the sorted keys at once, as BTree::VisitSorted does.
+	template <typename Visit>
+	void VisitSorted(const int* keys, size_t n, Visit visit) {
+		VisitSorted(root_, keys, 0, n, visit);
+	}
+
+	// Inserts the pairs with the n distinct sorted keys, as BTree::InsertSorted does.
+	void InsertSorted(const KeyValuePair* pairs, size_t n) {
+		for (size_t begin = 0; begin < n; ) {
+			if (root_->size == (2 * min_branching_degree_ - 1)) {
+				Node* new_root = pool_.Allocate(false);
+				new_root->children[0] = root_;
+				root_ = new_root;
+				SplitChild(new_root, 0);
+			}
+			begin = InsertSorted(root_, pairs, begin, n);
+		}
+	}
+
+	// Removes the n distinct sorted keys, as BTree::RemoveSorted does.
+	void RemoveSorted(const int* keys, size_t n) {
+		for (size_t begin = 0; begin < n; ) {
+			begin = RemoveSorted(root_, keys, begin, n);
+			if (root_->size == 0 && !root_->is_leaf) {
+				Node* tmp = root_;
+				root_ = root_->children[0];
+				pool_.Free(tmp);
+			}
+		}
+	}
+
+private:
+	int min_branching_degree_;
+	BTreeNodePool pool_;
+	Node* root_;
+	// The first and the last leaves of the chain.
+	Node* head_;
+	Node* tail_;
+
+	template <typename Visit>
+	static void VisitSorted(Node* node, const int* keys, size_t begin, size_t end, Visit& visit) {
+		if (node->is_leaf) {
+			for (size_t i = begin; i < end; ++i) {
+				int key_pos = KeySearch(node->keys, node->size, keys[i]);
+				visit(i, node->HasKeyAt(key_pos, keys[i]) ? &node->values[key_pos] : nullptr);
+			}
+			return;
+		}
+		while (begin < end) {
+			int child_index = BPlusChildIndex(node, keys[begin]);
+			// The keys less than the next separator go down to the same child.
+			size_t child_end = child_index == node->size ? end
+				: std::lower_bound(keys + begin, keys + end, node->keys[child_index]) - keys;
+			VisitSorted(node->children[child_index], keys, begin, child_end, visit);
+			begin = child_end;
+		}
+	}
+
+	// Inserts pairs[begin], pairs[begin + 1], ... into the subtree of the non-full node, as BTree::InsertSorted
+	// does, and returns the index of the first pair left.
+	size_t InsertSorted(Node* node, const KeyValuePair* pairs, size_t begin, size_t end) {
+		const int max_size = 2 * min_branching_degree_ - 1;
+		while (begin < end) {
+			if (node->is_leaf) {
+				int key_pos = KeySearch(node->keys, node->size, pairs[begin].key);
+				if (!node->HasKeyAt(key_pos, pairs[begin].key)) {
+					if (node->size == max_size) {
+						break;
+					}
+					node->InsertKeyValue(key_pos, pairs[begin]);
+				}
+				++begin;
+				continue;
+			}
+			int child_index = BPlusChildIndex(node, pairs[begin].key);
+			if (node->children[child_index]->size == max_size) {
+				if (node->size == max_size) {
+					break;
+				}
+				SplitChild(node, child_index);
+				continue;
+			}
+			// The pairs less than the next separator go down to the same child.
+			size_t child_end = child_index == node->size ? end
+				: std::lower_bound(pairs + begin, pairs + end, node->keys[child_index],
+					[](const KeyValuePair& pair, int key) { return pair.key < key; }) - pairs;
+			begin = InsertSorted(node->children[child_index], pairs, begin, child_end);
+		}
+		return begin;
+	}
+
+	// Removes keys[begin], keys[begin + 1], ... from the subtree of the node, as BTree::RemoveSorted does, and
+	// returns the index of the first key left.
+	size_t RemoveSorted(Node* node, const int* keys, size_t begin, size_t end) {
+		while (begin < end && CanLoseKey(node)) {
+			if (node->is_leaf) {
+				int key_pos = KeySearch(node->keys, node->size, keys[begin]);
+				if (node->HasKeyAt(key_pos, keys[begin])) {
+					node->RemoveKeyValue(key_pos);
+				}
+				++begin;
+				continue;
+			}
+			int child_index = BPlusChildIndex(node, keys[begin]);
+			if (node->children[child_index]->size < min_branching_degree_) {
+				Fill(node, child_index);
+				continue;
+			}
+			// The keys less than the next separator go down to the same child.
+			size_t child_end = child_index == node->size ? end
+				: std::lower_bound(keys + begin, keys + end, node->keys[child_index]) - keys;
+			begin = RemoveSorted(node->children[child_index], keys, begin, child_end);
+		}
+		return begin;
+	}
+
+	const Node* FindLeaf(int key) const {
+		const Node* node = root_;
+		while (!node->is_leaf) {
+			node = node->children[BPlusChildIndex(node, key)];
+		}
+		return node;
+	}
+
+	// Splitting the child_id'th child of the node into two parts. A leaf keeps all its pairs and the first
+	// key of the right part is copied up; an internal node gives its middle key to the parent, as in BTree.
+	void SplitChild(Node* node, int child_id) {
+		Node* left = node->children[child_id];
+		Node* right = pool_.Allocate(left->is_leaf);
+		if (left->is_leaf) {
+			int center = left->size / 2;
+			right->AppendKeyValues(left, center, left->size - center);
+			left->size = center;
+			Link(left, right);
+			node->InsertChild(child_id + 1, right);
+			node->InsertKeyValue(child_id, right->GetKeyValue(0));
+		} else {
+			int center_key_id = left->size / 2;
+			right->AppendKeyValues(left, center_key_id + 1, left->size - (center_key_id + 1));
+			std::copy(left->children + (center_key_id + 1), left->children + (left->size + 1), right->children);
+			node->InsertChild(child_id + 1, right);
+			node->InsertKeyValue(child_id, left->GetKeyValue(center_key_id));
+			left->size = center_key_id;
+		}
+	}
+
+	// Puts the new leaf after the given one in the chain.
+	void Link(Node* leaf, Node* new_leaf) {
+		new_leaf->prev = leaf;
+		new_leaf->next = leaf->next;
+		if (leaf->next != nullptr) {
+			leaf->next->prev = new_leaf;
+		} else {
+			tail_ = new_leaf;
+		}
+		leaf->next = new_leaf;
+	}
+
+	void Unlink(Node* leaf) {
+		(leaf->prev != nullptr ? leaf->prev->next : head_) = leaf->next;
+		(leaf->next != nullptr ? leaf->next->prev : tail_) = leaf->prev;
+	}
+
+	// Merges the [index]'th and [index + 1]'th children of the node. Leaves are simply concatenated and their
+	// separator is dropped; internal nodes take the separator down, as in BTree.
+	void Merge(Node* node, int index) {
+		Node* child = node->children[index];
+		Node* sibling = node->children[index + 1];
+
+		if (child->is_leaf) {
+			Unlink(sibling);
+		} else {
+			child->SetKeyValue(child->size++, node->GetKeyValue(index));
+			std::copy(sibling->children, sibling->children + (sibling->size + 1), child->children + child->size);
+		}
+		child->AppendKeyValues(sibling, 0, sibling->size);
+
+		node->RemoveChild(index + 1);
+		node->RemoveKeyValue(index);
+
+		pool_.Free(sibling);
+	}
+
+	// Gives the index'th child of the node at least t keys and returns its new index.
+	int Fill(Node* node, int index) {
+		Node* child = node->children[index];
+		if (index != 0 && CanTakeFrom(node->children[index - 1])) {
+			if (child->is_leaf) {
+				// Moving the last pair of the previous leaf, which becomes the least key of the child.
+				Node* prev = node->children[index - 1];
+				child->InsertKeyValue(0, prev->GetKeyValue(--prev->size));
+				node->keys[index - 1] = child->keys[0];
+			} else {
+				node->TakeFromPrevious(index);
+			}
+		} else if (index != node->size && CanTakeFrom(node->children[index + 1])) {
+			if (child->is_leaf) {
+				Node* next = node->children[index + 1];
+				child->AppendKeyValue(next->GetKeyValue(0));
+				next->RemoveKeyValue(0);
+				node->keys[index] = next->keys[0];
+			} else {
+				node->TakeFromNext(index);
+			}
+		} else if (index != node->size) {
+			Merge(node, index);
+		} else {
+			Merge(node, --index);
+		}
+		return index;
+	}
+
+	// Indicates whether we can take payload from the node: it keeps at least t - 1 keys.
+	bool CanTakeFrom(const Node* node) const {
+		return node->size >= min_branching_degree_;
+	}
+
+	// Indicates whether a key may be removed from the node or merged down from it, as in BTree.
+	bool CanLoseKey(const Node* node) const {
+		return node == root_ ? node->size > 0 || node->is_leaf : node->size >= min_branching_degree_;
+	}
+};
+
+// A node of ConcurrentBTree. The version is a lock for the writers and a check for the readers: a reader remembers
+// it, reads the node without locking and then checks that it has not changed.
+struct ConcurrentBTreeNode : BasicBTreeNode<ConcurrentBTreeNode*> {
+	// Bits of the version; the rest of it counts the changes.
+	static constexpr uint64_t OBSOLETE{ 1 };
+	static constexpr uint64_t LOCKED{ 2 };
+
+	// Waits till the node is unlocked and gets its version. Returns false if the node is obsolete.
+	bool ReadLock(uint64_t& node_version) const {
+		node_version = version.load(std::memory_order_acquire);
+		while ((node_version & LOCKED) != 0) {
+			std::this_thread::yield();
+			node_version = version.load(std::memory_order_acquire);
+		}
+		return (node_version & OBSOLETE) == 0;
+	}
+
+	// Indicates whether the node has not changed since it had the version.
+	bool Validate(uint64_t node_version) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return version.load(std::memory_order_relaxed) == node_version;
+	}
+
+	// Locks the node if it still has the version.
+	bool Upgrade(uint64_t node_version) {
+		return version.compare_exchange_strong(node_version, node_version + LOCKED, std::memory_order_acquire);
+	}
+
+	// Waits till the node can be locked and locks it. The node must not be obsolete.
+	void Lock() {
+		uint64_t node_version;
+		while (!ReadLock(node_version) || !Upgrade(node_version)) {
+			std::this_thread::yield();
+		}
+	}
+
+	void Unlock() {
+		version.fetch_add(LOCKED, std::memory_order_release);
+	}
+
+	// Unlocks the node that is no longer in the tree.
+	void UnlockObsolete() {
+		version.fetch_add(LOCKED + OBSOLETE, std::memory_order_release);
+	}
+
+	std::atomic<uint64_t> version{ 0 };
+	// Next leaf in key order.
+	ConcurrentBTreeNode* next = nullptr;
+};
+
+// Thread-safe B+ tree (pairs only in the leaves, leaves chained) with optimistic lock coupling. Readers lock
+// nothing: they go down checking the version of each node after reading it and start over if a node changed.
+// Writers go down the same way and lock only the nodes they change. A full node on the way of an insert, or
+// a node with less than t keys on the way of a remove, is split, filled or merged with its parent and
+// siblings locked, and then the writer starts over; so the leaf is changed with only the leaf locked.
+// Nodes removed by merges are not reused while the tree lives, since readers may still be in them.
+// BulkLoad must not run along with other calls.
+class ConcurrentBTree {
+public:
+	using KeyType = int;
+	using Node = ConcurrentBTreeNode;
+
+	explicit ConcurrentBTree(int min_branching_degree)
+		: min_branching_degree_(min_branching_degree), pool_(min_branching_degree), root_(pool_.Allocate(true)) {}
+
+	// Inserts the given key-value pair into the tree. If the key already present, returns false and does nothing.
+	bool Insert(int key, int value) {
+		bool is_inserted = false;
+		while (!TryInsert(key, value, is_inserted)) {
+		}
+		return is_inserted;
+	}
+
+	SearchResponse Search(int key) const {
+		SearchResponse response{ false, 0 };
+		while (!TrySearch(key, response)) {
+		}
+		return response;
+	}
+
+	SearchResponse Remove(int key) {
+		SearchResponse response{ false, 0 };
+		while (!TryRemove(key, response)) {
+		}
+		return response;
+	}
+
+	// Replaces the contents of the tree with the given pairs, as BPlusTree::BulkLoad does.
+	void BulkLoad(std::vector<KeyValuePair> pairs, double fill_factor = 1.0) {
+		PrepareToLoad(pairs);
+		pool_.Clear();
+		const size_t node_size = LoadedNodeSize(min_branching_degree_, fill_factor);
+		std::vector<KeyValuePair> separators;
+		std::vector<Node*> leaves = MakeLeaves(pool_, pairs, min_branching_degree_, node_size, separators);
+		root_.store(leaves.size() == 1 ? leaves.front()
+			: BuildLevels<Node*>(std::move(separators), std::move(leaves), min_branching_degree_, node_size, MakeNodeIn(pool_)));
+	}
+
+	// Calls visit(pair) for the pairs with keys from lo to hi, in key order. The pairs of a leaf are copied and
+	// visited once the leaf is checked to be unchanged; if it has changed, the scan goes on from a new descent.
+	template <typename Visit>
+	void Range(int lo, int hi, Visit visit) const {
+		std::vector<KeyValuePair> pairs;
+		// The least key not visited yet.
+		int from = lo;
+		bool is_done = lo > hi;
+		while (!is_done) {
+			uint64_t version;
+			const Node* leaf = FindLeaf(from, version);
+			while (!is_done) {
+				pairs.clear();
+				for (int i = KeySearch(leaf->keys, leaf->size, from); i < leaf->size && leaf->keys[i] <= hi; ++i) {
+					pairs.push_back(leaf->GetKeyValue(i));
+				}
+				const Node* next = leaf->next;
+				is_done = next == nullptr || (leaf->size != 0 && leaf->keys[leaf->size - 1] >= hi);
+				if (!leaf->Validate(version)) {
+					is_done = false;
+					break;
+				}
+				for (const KeyValuePair& pair : pairs) {
+					visit(pair);
+				}
+				if (!pairs.empty()) {
+					is_done = is_done || pairs.back().key == hi;
+					from = pairs.back().key + (is_done ? 0 : 1);
+				}
+				// The leaf is checked again after the next one is reached, since pairs may have moved between them.
+				uint64_t next_version;
+				if (is_done || !next->ReadLock(next_version) || !leaf->Validate(version)) {
+					break;
+				}
+				leaf = next;
+				version = next_version;
+			}
+		}
+	}
+
+private:
+	int min_branching_degree_;
+	BasicNodePool<Node> pool_;
+	// Guards the pool.
+	std::mutex pool_mutex_;
+	std::atomic<Node*> root_;
+
+	Node* Allocate(bool is_leaf) {
+		std::lock_guard<std::mutex> lock(pool_mutex_);
+		return pool_.Allocate(is_leaf);
+	}
+
+	// Read-locks the root. Returns false if the root has changed meanwhile.
+	bool ReadLockRoot(Node*& root, uint64_t& version) const {
+		root = root_.load(std::memory_order_acquire);
+		return root->ReadLock(version) && root == root_.load(std::memory_order_acquire);
+	}
+
+	// Goes down from the read-locked node to the read-locked child on the way of the key.
+	static bool MoveDown(Node*& node, uint64_t& version, int key) {
+		Node* child = node->children[BPlusChildIndex(node, key)];
+		uint64_t child_version;
+		if (!ReadLockChild(node, version, child, child_version)) {
+			return false;
+		}
+		node = child;
+		version = child_version;
+		return true;
+	}
+
+	// Read-locks the child read from the read-locked node. The node is checked before the child is touched, so
+	// the child is a node, and after the child is locked, so the child was not split or merged in between.
+	static bool ReadLockChild(const Node* node, uint64_t version, const Node* child, uint64_t& child_version) {
+		return node->Validate(version) && child->ReadLock(child_version) && node->Validate(version);
+	}
+
+	// Finds the read-locked leaf that may hold the key. Starts over till no node changes on the way.
+	const Node* FindLeaf(int key, uint64_t& version) const {
+		for (;;) {
+			Node* node;
+			if (!ReadLockRoot(node, version)) {
+				continue;
+			}
+			bool is_valid = true;
+			while (is_valid && !node->is_leaf) {
+				is_valid = MoveDown(node, version, key);
+			}
+			if (is_valid) {
+				return node;
+			}
+		}
+	}
+
+	bool TrySearch(int key, SearchResponse& response) const {
+		uint64_t version;
+		const Node* leaf = FindLeaf(key, version);
+		int key_pos = KeySearch(leaf->keys, leaf->size, key);
+		response = leaf->HasKeyAt(key_pos, key) ? SearchResponse{ true, leaf->values[key_pos] } : SearchResponse{ false, 0 };
+		return leaf->Validate(version);
+	}
+
+	bool TryInsert(int key, int value, bool& is_inserted) {
+		Node* parent = nullptr;
+		uint64_t parent_version = 0;
+		Node* node;
+		uint64_t version;
+		if (!ReadLockRoot(node, version)) {
+			return false;
+		}
+		for (;;) {
+			if (node->size == 2 * min_branching_degree_ - 1) {
+				// Splitting the full node. It is still the child of the parent if the parent has not changed.
+				if (parent != nullptr && !parent->Upgrade(parent_version)) {
+					return false;
+				}
+				if (!node->Upgrade(version)) {
+					if (parent != nullptr) {
+						parent->Unlock();
+					}
+					return false;
+				}
+				if (parent == nullptr) {
+					Node* new_root = Allocate(false);
+					new_root->children[0] = node;
+					SplitChild(new_root, 0);
+					root_.store(new_root, std::memory_order_release);
+				} else {
+					SplitChild(parent, BPlusChildIndex(parent, key));
+					parent->Unlock();
+				}
+				node->Unlock();
+				return false;
+			}
+			if (node->is_leaf) {
+				break;
+			}
+			parent = node;
+			parent_version = version;
+			if (!MoveDown(node, version, key)) {
+				return false;
+			}
+		}
+
+		// The leaf keeps its keys while its version is the same, so it is still the leaf for the key.
+		if (!node->Upgrade(version)) {
+			return false;
+		}
+		int key_pos = KeySearch(node->keys, node->size, key);
+		is_inserted = !node->HasKeyAt(key_pos, key);
+		if (is_inserted) {
+			node->InsertKeyValue(key_pos, { key, value });
+		}
+		node->Unlock();
+		return true;
+	}
+
+	bool TryRemove(int key, SearchResponse& response) {
+		Node* node;
+		uint64_t version;
+		if (!ReadLockRoot(node, version)) {
+			return false;
+		}
+		while (!node->is_leaf) {
+			int index = BPlusChildIndex(node, key);
+			Node* child = node->children[index];
+			uint64_t child_version;
+			if (!ReadLockChild(node, version, child, child_version)) {
+				return false;
+			}
+			if (child->size < min_branching_degree_) {
+				if (!node->Upgrade(version)) {
+					return false;
+				}
+				if (!child->Upgrade(child_version)) {
+					node->Unlock();
+					return false;
+				}
+				Fill(node, index);
+				return false;
+			}
+			node = child;
+			version = child_version;
+		}
+
+		if (!node->Upgrade(version)) {
+			return false;
+		}
+		int key_pos = KeySearch(node->keys, node->size, key);
+		response = { false, 0 };
+		if (node->HasKeyAt(key_pos, key)) {
+			response = { true, node->values[key_pos] };
+			node->RemoveKeyValue(key_pos);
+		}
+		node->Unlock();
+		return true;
+	}
+
+	// Splitting the child_id'th child of the locked node into two parts, as BPlusTree::SplitChild does. The child
+	// must be locked too.
+	void SplitChild(Node* node, int child_id) {
+		Node* left = node->children[child_id];
+		Node* right = Allocate(left->is_leaf);
+		if (left->is_leaf) {
+			int center = left->size / 2;
+			right->AppendKeyValues(left, center, left->size - center);
+			right->next = left->next;
+			left->next = right;
+			left->size = center;
+			node->InsertChild(child_id + 1, right);
+			node->InsertKeyValue(child_id, right->GetKeyValue(0));
+		} else {
+			int center_key_id = left->size / 2;
+			right->AppendKeyValues(left, center_key_id + 1, left->size - (center_key_id + 1));
+			std::copy(left->children + (center_key_id + 1), left->children + (left->size + 1), right->children);
+			node->InsertChild(child_id + 1, right);
+			node->InsertKeyValue(child_id, left->GetKeyValue(center_key_id));
+			left->size = center_key_id;
+		}
+	}
+
+	// Gives the index'th child of the node at least t keys, as BPlusTree::Fill does, and unlocks the node and
+	// the child, which must be locked. A sibling is locked while it is changed. If the node is the root and
+	// has lost its last key, its only child becomes the root.
+	void Fill(Node* node, int index) {
+		Node* child = node->children[index];
+		Node* prev = index != 0 ? node->children[index - 1] : nullptr;
+		Node* next = index != node->size ? node->children[index + 1] : nullptr;
+		// Siblings are locked only under the locked parent, so no one else waits for them.
+		if (prev != nullptr) {
+			prev->Lock();
+			if (CanTakeFrom(prev)) {
+				if (child->is_leaf) {
+					child->InsertKeyValue(0, prev->GetKeyValue(--prev->size));
+					node->keys[index - 1] = child->keys[0];
+				} else {
+					node->TakeFromPrevious(index, child, prev);
+				}
+				prev->Unlock();
+				child->Unlock();
+				node->Unlock();
+				return;
+			}
+		}
+		if (next != nullptr) {
+			next->Lock();
+			if (CanTakeFrom(next)) {
+				if (child->is_leaf) {
+					child->AppendKeyValue(next->GetKeyValue(0));
+					next->RemoveKeyValue(0);
+					node->keys[index] = next->keys[0];
+				} else {
+					node->TakeFromNext(index, child, next);
+				}
+				next->Unlock();
+				if (prev != nullptr) {
+					prev->Unlock();
+				}
+				child->Unlock();
+				node->Unlock();
+				return;
+			}
+		}
+		// Merging with the next sibling or, for the last child, into the previous one.
+		if (next != nullptr) {
+			Merge(node, index);
+			next->UnlockObsolete();
+			child->Unlock();
+			if (prev != nullptr) {
+				prev->Unlock();
+			}
+		} else {
+			Merge(node, index - 1);
+			child->UnlockObsolete();
+			prev->Unlock();
+		}
+		if (node->size == 0) {
+			root_.store(node->children[0], std::memory_order_release);
+			node->UnlockObsolete();
+		} else {
+			node->Unlock();
+		}
+	}
+
+	// Merges the [index]'th and [index + 1]'th children of the locked node, which must be locked too.
+	static void Merge(Node* node, int index) {
+		Node* child = node->children[index];
+		Node* sibling = node->children[index + 1];
+		if (child->is_leaf) {
+			child->next = sibling->next;
+		} else {
+			child->SetKeyValue(child->size++, node->GetKeyValue(index));
+			std::copy(sibling->children, sibling->children + (sibling->size + 1), child->children + child->size);
+		}
+		child->AppendKeyValues(sibling, 0, sibling->size);
+
+		node->RemoveChild(index + 1);
+		node->RemoveKeyValue(index);
+	}
+
+	bool CanTakeFrom(const Node* node) const {
+		return node->size >= min_branching_degree_;
+	}
+};
+
+// Number of a page in a page file.
+using PageId = uint32_t;
+// Page 0 of a file holds its header, so no node has this ID.
+constexpr PageId NO_PAGE{ 0 };
+
+// A file of fixed-size pages.
+class PageFile {
+public:
+	PageFile(const std::string& path, size_t page_size) : page_size_(page_size) {
+		file_.open(path, std::ios::in | std::ios::out | std::ios::binary);
+		if (!file_.is_open()) {
+			// Creating the file, which cannot be done in the read-write mode.
+			std::ofstream(path, std::ios::binary);
+			file_.open(path, std::ios::in | std::ios::out | std::ios::binary);
+		}
+		if (!file_.is_open()) {
+			throw std::runtime_error("Cannot open file " + path);
+		}
+		file_.seekg(0, std::ios::end);
+		num_of_pages_ = static_cast<PageId>(static_cast<size_t>(file_.tellg()) / page_size_);
+	}
+
+	size_t GetPageSize() const {
+		return page_size_;
+	}
+
+	// Number of the pages in the file when it was opened.
+	PageId GetNumOfPages() const {
+		return num_of_pages_;
+	}
+
+	void Read(PageId page, char* data) {
+		file_.seekg(GetOffset(page));
+		file_.read(data, static_cast<std::streamsize>(page_size_));
+		if (!file_) {
+			throw std::runtime_error("Cannot read page " + std::to_string(page));
+		}
+	}
+
+	void Write(PageId page, const char* data) {
+		file_.seekp(GetOffset(page));
+		file_.write(data, static_cast<std::streamsize>(page_size_));
+		if (!file_) {
+			throw std::runtime_error("Cannot write page " + std::to_string(page));
+		}
+	}
+
+	void Flush() {
+		file_.flush();
+	}
+
+private:
+	std::fstream file_;
+	size_t page_size_;
+	PageId num_of_pages_;
+
+	std::streamoff GetOffset(PageId page) const {
+		return static_cast<std::streamoff>(page) * static_cast<std::streamoff>(page_size_);
+	}
+};
+
+// Keeps as many pages of the file in memory as the memory budget allows. Pages are pinned while they are used;
+// the unpinned ones are evicted by the CLOCK algorithm: the hand passes a frame as many times as its usage
+// count before it takes the frame. Dirty pages are written back in batches, ordered by page, when the hand
+// gets to one of them, or all at once by Flush.
+class BufferPool {
+public:
+	// Least number of frames, more than a tree can keep pinned at once.
+	static constexpr size_t MIN_FRAMES{ 64 };
+	// Largest number of dirty pages written back at once.
+	static constexpr size_t WRITE_BATCH{ 64 };
+	static constexpr size_t ALIGNMENT{ 64 };
+
+	BufferPool(PageFile& file, size_t memory_budget)
+		: file_(file), frames_(std::max(MIN_FRAMES, memory_budget / file.GetPageSize())),
+		memory_(new char[frames_.size() * file.GetPageSize() + ALIGNMENT]) {
+		char* data = memory_.get() + (ALIGNMENT - reinterpret_cast<uintptr_t>(memory_.get()) % ALIGNMENT) % ALIGNMENT;
+		for (Frame& frame : frames_) {
+			frame.data = data;
+			data += file.GetPageSize();
+		}
+	}
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	// Pins the page, reading it from the file if it is not in memory, and returns its frame.
+	size_t Pin(PageId page) {
+		auto found = frame_of_page_.find(page);
+		size_t frame;
+		if (found != frame_of_page_.end()) {
+			frame = found->second;
+		} else {
+			frame = TakeFrame(page);
+			file_.Read(page, frames_[frame].data);
+		}
+		++frames_[frame].pins;
+		return frame;
+	}
+
+	// Pins a page that is not in the file yet. Its frame is zeroed.
+	size_t PinNew(PageId page) {
+		size_t frame = TakeFrame(page);
+		std::memset(frames_[frame].data, 0, file_.GetPageSize());
+		frames_[frame].is_dirty = true;
+		++frames_[frame].pins;
+		return frame;
+	}
+
+	// Unpins the page of the frame. The page is kept in memory for at least `usage` turns of the clock.
+	void Unpin(size_t frame, bool is_dirty, int usage) {
+		--frames_[frame].pins;
+		frames_[frame].is_dirty = frames_[frame].is_dirty || is_dirty;
+		frames_[frame].usage = std::max(frames_[frame].usage, usage);
+	}
+
+	char* GetData(size_t frame) const {
+		return frames_[frame].data;
+	}
+
+	// Writes all dirty pages back.
+	void Flush() {
+		std::vector<size_t> dirty;
+		for (size_t i = 0; i < frames_.size(); ++i) {
+			if (frames_[i].is_dirty) {
+				dirty.push_back(i);
+			}
+		}
+		WriteBack(dirty);
+		file_.Flush();
+	}
+
+	// Drops all pages without writing them back. No page may be pinned.
+	void Clear() {
+		for (Frame& frame : frames_) {
+			frame = Frame{ NO_PAGE, 0, 0, false, frame.data };
+		}
+		frame_of_page_.clear();
+	}
+
+private:
+	struct Frame {
+		PageId page = NO_PAGE;
+		int pins = 0;
+		int usage = 0;
+		bool is_dirty = false;
+		char* data = nullptr;
+	};
+
+	PageFile& file_;
+	std::vector<Frame> frames_;
+	std::unique_ptr<char[]> memory_;
+	std::unordered_map<PageId, size_t> frame_of_page_;
+	size_t hand_ = 0;
+
+	// Finds a frame for the page, evicting the page in it.
+	size_t TakeFrame(PageId page) {
+		// Every turn of the clock lowers the usage of each frame, so a frame is found in a few turns unless
+		// all of them are pinned.
+		for (size_t step = 0; step < 8 * frames_.size(); ++step) {
+			size_t frame = hand_;
+			hand_ = (hand_ + 1) % frames_.size();
+			Frame& victim = frames_[frame];
+			if (victim.pins > 0) {
+				continue;
+			}
+			if (victim.page != NO_PAGE && victim.usage > 0) {
+				--victim.usage;
+				continue;
+			}
+			if (victim.is_dirty) {
+				WriteBackFrom(frame);
+			}
+			if (victim.page != NO_PAGE) {
+				frame_of_page_.erase(victim.page);
+			}
+			victim.page = page;
+			victim.usage = 0;
+			frame_of_page_[page] = frame;
+			return frame;
+		}
+		throw std::runtime_error("The buffer pool is too small: all pages are pinned.");
+	}
+
+	// Writes back the dirty unpinned page of the frame along with those the hand gets to next.
+	void WriteBackFrom(size_t frame) {
+		std::vector<size_t> batch{ frame };
+		for (size_t i = 1; i < frames_.size() && batch.size() < WRITE_BATCH; ++i) {
+			size_t next = (frame + i) % frames_.size();
+			if (frames_[next].is_dirty && frames_[next].pins == 0) {
+				batch.push_back(next);
+			}
+		}
+		WriteBack(batch);
+	}
+
+	void WriteBack(std::vector<size_t>& batch) {
+		// In page order, so that the writes go through the file in one direction.
+		std::sort(batch.begin(), batch.end(), [this](size_t left, size_t right) {
+			return frames_[left].page < frames_[right].page;
+		});
+		for (size_t frame : batch) {
+			file_.Write(frames_[frame].page, frames_[frame].data);
+			frames_[frame].is_dirty = false;
+		}
+	}
+};
+
+// "PBTREE1" in a little-endian file.
+constexpr uint64_t PAGED_TREE_MAGIC{ 0x31454552544250 };
+
+// Page 0 of the file of a PagedBTree.
+struct PagedTreeHeader {
+	uint64_t magic;
+	int32_t min_branching_degree;
+	uint32_t page_size;
+	PageId root;
+	PageId num_of_pages;
+	// Freed pages, each holding the ID of the next one at its start.
+	PageId free_list;
+};
+
+// BTree kept in a file, one node per page, with children referred to by page IDs. Only the pages in the buffer
+// pool are in memory, so the tree may be larger than the memory budget. The clock keeps the internal nodes
+// several turns longer than the leaves, so the upper levels, which every descent goes through, stay in memory.
+// If the file already holds a tree with the same t, the tree is opened; otherwise a new one is made.
+// The pages and the header are written back by Flush and when the tree is destroyed.
+class PagedBTree {
+public:
+	using KeyType = int;
+	using Node = BasicBTreeNode<PageId>;
+	// Page size is a multiple of this.
+	static constexpr size_t PAGE_ALIGNMENT{ 4096 };
+	// Clock turns for which unpinned leaves and internal nodes stay in memory.
+	static constexpr int LEAF_USAGE{ 1 };
+	static constexpr int INTERNAL_NODE_USAGE{ 3 };
+
+	PagedBTree(const std::string& path, int min_branching_degree, size_t memory_budget)
+		: min_branching_degree_(min_branching_degree), layout_(min_branching_degree, PAGE_ALIGNMENT),
+		file_(path, layout_.size), pool_(file_, memory_budget) {
+		if (file_.GetNumOfPages() == 0) {
+			header_ = { PAGED_TREE_MAGIC, min_branching_degree, static_cast<uint32_t>(layout_.size), NO_PAGE, 1, NO_PAGE };
+			header_.root = NewNode(true).GetPage();
+			return;
+		}
+		std::vector<char> page(layout_.size);
+		file_.Read(0, page.data());
+		std::memcpy(&header_, page.data(), sizeof(header_));
+		if (header_.magic != PAGED_TREE_MAGIC || header_.min_branching_degree != min_branching_degree
+			|| header_.page_size != layout_.size) {
+			throw std::runtime_error("The file " + path + " does not hold a tree with this t.");
+		}
+	}
+
+	PagedBTree(const PagedBTree&) = delete;
+	PagedBTree& operator=(const PagedBTree&) = delete;
+
+	~PagedBTree() {
+		try {
+			Flush();
+		} catch (std::runtime_error& e) {
+			std::cerr << e.what();
+		}
+	}
+
+	// Inserts the given key-value pair into the tree. If the key already present, returns false and does nothing.
+	bool Insert(int key, int value) {
+		if (Search(key).is_found) {
+			return false;
+		}
+
+		PageId page = header_.root;
+		{
+			NodeRef root(*this, page);
+			if (root->size == (2 * min_branching_degree_ - 1)) {
+				NodeRef new_root = NewNode(false);
+				new_root->children[0] = page;
+				page = header_.root = new_root.GetPage();
+				SplitChild(new_root, 0, root);
+			}
+		}
+		// Going down, a full child is split before the descent into it.
+		for (;;) {
+			NodeRef node(*this, page);
+			int i = KeySearch(node->keys, node->size, key);
+			if (node->is_leaf) {
+				node->InsertKeyValue(i, { key, value });
+				node.MarkDirty();
+				return true;
+			}
+			NodeRef child(*this, node->children[i]);
+			if (child->size == (2 * min_branching_degree_ - 1)) {
+				SplitChild(node, i, child);
+				if (key > node->keys[i]) {
+					++i;
+				}
+			}
+			page = node->children[i];
+		}
+	}
+
+	SearchResponse Search(int key) {
+		PageId page = header_.root;
+		for (;;) {
+			NodeRef node(*this, page);
+			int key_pos = KeySearch(node->keys, node->size, key);
+			if (node->HasKeyAt(key_pos, key)) {
+				return SearchResponse{ true, node->values[key_pos] };
+			} else if (node->is_leaf) {
+				return SearchResponse{ false, 0 };
+			}
+			page = node->children[key_pos];
+		}
+	}
+
+	// Replaces the contents of the tree with the given pairs, as BTree::BulkLoad does. The nodes are written
+	// to the file in the order they are made.
+	void BulkLoad(std::vector<KeyValuePair> pairs, double fill_factor = 1.0) {
+		PrepareToLoad(pairs);
+		pool_.Clear();
+		header_.num_of_pages = 1;
+		header_.free_list = NO_PAGE;
+		header_.root = BuildLevels<PageId>(std::move(pairs), {}, min_branching_degree_,
+			LoadedNodeSize(min_branching_degree_, fill_factor),
+			[this](const std::vector<KeyValuePair>& level, const std::vector<PageId>& children, size_t begin, size_t size) {
+				NodeRef node = NewNode(children.empty());
+				for (size_t i = begin; i < begin + size; ++i) {
+					node->AppendKeyValue(level[i]);
+				}
+				if (!children.empty()) {
+					std::copy(children.begin() + begin, children.begin() + (begin + size + 1), node->children);
+				}
+				return node.GetPage();
+			});
+	}
+
+	// Removes the key as BTree::Remove does, but goes down in a loop, holding only the pages of one level.
+	SearchResponse Remove(int key) {
+		SearchResponse result{ false, 0 };
+		PageId page = header_.root;
+		for (;;) {
+			NodeRef node(*this, page);
+			int key_pos = KeySearch(node->keys, node->size, key);
+			if (node->HasKeyAt(key_pos, key)) {
+				// Further on the key is the one that replaced the removed key.
+				if (!result.is_found) {
+					result = { true, node->values[key_pos] };
+				}
+				if (node->is_leaf) {
+					node->RemoveKeyValue(key_pos);
+					node.MarkDirty();
+					break;
+				}
+				// Replacing the key with its predecessor or successor, which is removed then, or merging the
+				// children around it and removing it from the merged child.
+				if (CanTakeFrom(node->children[key_pos])) {
+					KeyValuePair pred = GetPredecessor(node->children[key_pos]);
+					node->SetKeyValue(key_pos, pred);
+					key = pred.key;
+				} else if (CanTakeFrom(node->children[key_pos + 1])) {
+					KeyValuePair succ = GetSuccessor(node->children[key_pos + 1]);
+					node->SetKeyValue(key_pos, succ);
+					key = succ.key;
+					++key_pos;
+				} else {
+					Merge(node, key_pos);
+				}
+				node.MarkDirty();
+				page = node->children[key_pos];
+			} else {
+				if (node->is_leaf) {
+					break;
+				}
+				if (!CanTakeFrom(node->children[key_pos])) {
+					key_pos = Fill(node, key_pos);
+				}
+				page = node->children[key_pos];
+			}
+		}
+
+		PageId old_root = header_.root;
+		{
+			NodeRef root(*this, old_root);
+			if (root->size == 0 && !root->is_leaf) {
+				header_.root = root->children[0];
+			}
+		}
+		if (header_.root != old_root) {
+			FreePage(old_root);
+		}
+		return result;
+	}
+
+	// Calls visit(pair) for the pairs with keys from lo to hi, in key order, as BTree::Range does.
+	template <typename Visit>
+	void Range(int lo, int hi, Visit visit) {
+		Range(header_.root, lo, hi, visit);
+	}
+
+	// Writes the dirty pages and the header to the file.
+	void Flush() {
+		pool_.Flush();
+		std::vector<char> page(layout_.size);
+		std::memcpy(page.data(), &header_, sizeof(header_));
+		file_.Write(0, page.data());
+		file_.Flush();
+	}
+
+private:
+	// A pinned node. It is in memory until the reference is gone.
+	class NodeRef {
+	public:
+		NodeRef(PagedBTree& tree, PageId page)
+			: tree_(tree), page_(page), frame_(tree.pool_.Pin(page)), node_(tree.layout_.Bind(tree.pool_.GetData(frame_))) {}
+
+		// A new node in a pinned new page.
+		NodeRef(PagedBTree& tree, PageId page, size_t frame, bool is_leaf)
+			: tree_(tree), page_(page), frame_(frame),
+			node_(tree.layout_.Bind(reinterpret_cast<char*>(new (tree.pool_.GetData(frame)) Node()))), is_dirty_(true) {
+			node_->is_leaf = is_leaf;
+		}
+
+		NodeRef(const NodeRef&) = delete;
+		NodeRef& operator=(const NodeRef&) = delete;
+
+		~NodeRef() {
+			tree_.pool_.Unpin(frame_, is_dirty_, node_->is_leaf ? LEAF_USAGE : INTERNAL_NODE_USAGE);
+		}
+
+		Node* operator->() const {
+			return node_;
+		}
+
+		Node* Get() const {
+			return node_;
+		}
+
+		PageId GetPage() const {
+			return page_;
+		}
+
+		void MarkDirty() {
+			is_dirty_ = true;
+		}
+
+	private:
+		PagedBTree& tree_;
+		PageId page_;
+		size_t frame_;
+		Node* node_;
+		bool is_dirty_ = false;
+	};
+
+	int min_branching_degree_;
+	NodeLayout<Node> layout_;
+	PageFile file_;
+	BufferPool pool_;
+	PagedTreeHeader header_;
+
+	NodeRef NewNode(bool is_leaf) {
+		PageId page = header_.free_list;
+		size_t frame;
+		if (page != NO_PAGE) {
+			frame = pool_.Pin(page);
+			std::memcpy(&header_.free_list, pool_.GetData(frame), sizeof(PageId));
+		} else {
+			page = header_.num_of_pages++;
+			frame = pool_.PinNew(page);
+		}
+		return NodeRef(*this, page, frame, is_leaf);
+	}
+
+	void FreePage(PageId page) {
+		size_t frame = pool_.Pin(page);
+		std::memcpy(pool_.GetData(frame), &header_.free_list, sizeof(PageId));
+		header_.free_list = page;
+		pool_.Unpin(frame, true, 0);
+	}
+
+	KeyValuePair GetPredecessor(PageId page) {
+		for (;;) {
+			NodeRef node(*this, page);
+			if (node->is_leaf) {
+				return node->GetKeyValue(node->size - 1);
+			}
+			page = node->children[node->size];
+		}
+	}
+
+	KeyValuePair GetSuccessor(PageId page) {
+		for (;;) {
+			NodeRef node(*this, page);
+			if (node->is_leaf) {
+				return node->GetKeyValue(0);
+			}
+			page = node->children[0];
+		}
+	}
+
+	template <typename Visit>
+	void Range(PageId page, int lo, int hi, Visit& visit) {
+		NodeRef node(*this, page);
+		for (int i = KeySearch(node->keys, node->size, lo); ; ++i) {
+			if (!node->is_leaf) {
+				Range(node->children[i], lo, hi, visit);
+			}
+			if (i == node->size || node->keys[i] > hi) {
+				return;
+			}
+			visit(node->GetKeyValue(i));
+		}
+	}
+
+	// Splitting the child_id'th child of the node into two parts.
+	void SplitChild(NodeRef& node, int child_id, NodeRef& left) {
+		int center_key_id = left->size / 2;
+		NodeRef right = NewNode(left->is_leaf);
+
+		right->AppendKeyValues(left.Get(), center_key_id + 1, left->size - (center_key_id + 1));
+		if (!left->is_leaf) {
+			std::copy(left->children + (center_key_id + 1), left->children + (left->size + 1), right->children);
+		}
+
+		node->InsertChild(child_id + 1, right.GetPage());
+		node->InsertKeyValue(child_id, left->GetKeyValue(center_key_id));
+
+		left->size = center_key_id;
+		node.MarkDirty();
+		left.MarkDirty();
+	}
+
+	// Merges the [index]'th and [index + 1]'th children of the node.
+	void Merge(NodeRef& node, int index) {
+		PageId sibling_page = node->children[index + 1];
+		{
+			NodeRef child(*this, node->children[index]);
+			NodeRef sibling(*this, sibling_page);
+
+			child->SetKeyValue(child->size++, node->GetKeyValue(index));
+			if (!child->is_leaf) {
+				std::copy(sibling->children, sibling->children + (sibling->size + 1), child->children + child->size);
+			}
+			child->AppendKeyValues(sibling.Get(), 0, sibling->size);
+			child.MarkDirty();
+		}
+
+		node->RemoveChild(index + 1);
+		node->RemoveKeyValue(index);
+		node.MarkDirty();
+
+		FreePage(sibling_page);
+	}
+
+	// Gives the index'th child of the node at least t keys and returns its new index.
+	int Fill(NodeRef& node, int index) {
+		// The child is unpinned before a merge, which may free its page.
+		{
+			NodeRef child(*this, node->children[index]);
+			if (index != 0) {
+				NodeRef prev(*this, node->children[index - 1]);
+				if (CanTakeFrom(prev.Get())) {
+					node->TakeFromPrevious(index, child.Get(), prev.Get());
+					node.MarkDirty();
+					child.MarkDirty();
+					prev.MarkDirty();
+					return index;
+				}
+			}
+			if (index != node->size) {
+				NodeRef next(*this, node->children[index + 1]);
+				if (CanTakeFrom(next.Get())) {
+					node->TakeFromNext(index, child.Get(), next.Get());
+					node.MarkDirty();
+					child.MarkDirty();
+					next.MarkDirty();
+					return index;
+				}
+			}
+		}
+		if (index != node->size) {
+			Merge(node, index);
+		} else {
+			Merge(node, --index);
+		}
+		return index;
+	}
+
+	bool CanTakeFrom(const Node* node) const {
+		return node->size >= min_branching_degree_;
+	}
+
+	bool CanTakeFrom(PageId page) {
+		return CanTakeFrom(NodeRef(*this, page).Get());
+	}
+};
+
+struct FileCloser {
+	void operator()(std::FILE* file) const {
+		std::fclose(file);
+	}
+};
+
+using FilePointer = std::unique_ptr<std::FILE, FileCloser>;
+
+inline FilePointer OpenFile(const std::string& path, const char* mode) {
+	FilePointer file(std::fopen(path.c_str(), mode));
+	if (file == nullptr) {
+		throw std::runtime_error("Cannot open file " + path);
+	}
+	return file;
+}
+
+inline void WriteBytes(std::FILE* file, const void* data, size_t size) {
+	if (std::fwrite(data, 1, size, file) != size) {
+		throw std::runtime_error("Cannot write to a file.");
+	}
+}
+
+// Makes the written data durable: flushes the buffers of the stream and then those of the OS.
+inline void SyncFile(std::FILE* file) {
+#if defined(_MSC_VER)
+	bool is_synced = std::fflush(file) == 0 && _commit(_fileno(file)) == 0;
+#else
+	bool is_synced = std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+#endif
+	if (!is_synced) {
+		throw std::runtime_error("Cannot write a file to the disk.");
+	}
+}
+
+// Makes the renames and creations of files in the directory durable. On Windows they are made durable
+// by the file system itself, and a directory cannot be flushed.
+inline void SyncDirectory(const std::filesystem::path& path) {
+#if !defined(_MSC_VER)
+	const int directory = open(path.c_str(), O_RDONLY);
+	bool is_synced = directory >= 0 && fsync(directory) == 0;
+	if (directory >= 0) {
+		close(directory);
+	}
+	if (!is_synced) {
+		throw std::runtime_error("Cannot write the directory " + path.string() + " to the disk.");
+	}
+#else
+	(void)path;
+#endif
+}
+
+// FNV-1a hash of the bytes, to tell damaged data.
+inline uint32_t Checksum(const void* data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Log of the mutations of a tree since its last checkpoint. Records are appended to a buffer in memory, and a
+// committer thread writes the buffer out with one fsync every commit interval (group commit), so a mutation
+// costs an append to memory and a crash loses the mutations of the last interval at most. Each write is a frame:
+// the size and checksum of its records and then the records. Recovery stops at the first torn or damaged frame.
+// The log starts with the generation of the checkpoint it follows. Append, Commit and Restart are called
+// by one thread.
+class WriteAheadLog {
+public:
+	struct Record {
+		enum class Type : int32_t { INSERT, DELETE };
+
+		Type type;
+		int32_t key;
+		int32_t value;
+	};
+
+	// Starts an empty log of the given generation in the file.
+	WriteAheadLog(const std::string& path, std::chrono::milliseconds commit_interval, uint64_t generation)
+		: path_(path), commit_interval_(commit_interval) {
+		Start(generation);
+		committer_ = std::thread(&WriteAheadLog::CommitLoop, this);
+	}
+
+	WriteAheadLog(const WriteAheadLog&) = delete;
+	WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+	// Commits the rest of the records.
+	~WriteAheadLog() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			is_stopped_ = true;
+		}
+		wake_.notify_one();
+		committer_.join();
+	}
+
+	void Append(const Record& record) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		CheckError();
+		buffer_.push_back(record);
+		++num_of_appended_;
+		if (buffer_.size() == 1) {
+			wake_.notify_one();
+		}
+	}
+
+	// Waits till the records appended so far are on the disk.
+	void Commit() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		const uint64_t target = num_of_appended_;
+		is_commit_requested_ = true;
+		wake_.notify_one();
+		committed_.wait(lock, [this, target] { return num_of_committed_ >= target || !error_.empty(); });
+		CheckError();
+	}
+
+	// Commits the records and empties the log, which now follows the checkpoint of the given generation.
+	void Restart(uint64_t generation) {
+		Commit();
+		std::lock_guard<std::mutex> lock(mutex_);
+		Start(generation);
+	}
+
+	// Number of records since the log was started.
+	uint64_t GetNumOfRecords() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return num_of_appended_;
+	}
+
+	// Calls visit(record) for the records of the log in the file, if it is of the given generation.
+	template <typename Visit>
+	static void Replay(const std::string& path, uint64_t generation, Visit visit) {
+		FilePointer file(std::fopen(path.c_str(), "rb"));
+		Header header;
+		if (file == nullptr || std::fread(&header, sizeof(header), 1, file.get()) != 1
+			|| header.magic != MAGIC || header.generation != generation) {
+			return;
+		}
+		std::vector<Record> records;
+		FrameHeader frame;
+		while (std::fread(&frame, sizeof(frame), 1, file.get()) == 1 && frame.size % sizeof(Record) == 0) {
+			records.resize(frame.size / sizeof(Record));
+			if (std::fread(records.data(), 1, frame.size, file.get()) != frame.size
+				|| Checksum(records.data(), frame.size) != frame.checksum) {
+				return;
+			}
+			for (const Record& record : records) {
+				visit(record);
+			}
+		}
+	}
+
+private:
+	static constexpr uint64_t MAGIC{ 0x31474f4c45455254 };
+
+	struct Header {
+		uint64_t magic;
+		uint64_t generation;
+	};
+
+	struct FrameHeader {
+		uint32_t size;
+		uint32_t checksum;
+	};
+
+	std::string path_;
+	std::chrono::milliseconds commit_interval_;
+	FilePointer file_;
+	mutable std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable committed_;
+	std::vector<Record> buffer_;
+	uint64_t num_of_appended_ = 0;
+	uint64_t num_of_committed_ = 0;
+	bool is_commit_requested_ = false;
+	bool is_stopped_ = false;
+	// Message of the failure of the committer, thrown to the owner.
+	std::string error_;
+	// Started last, when everything it uses is initialized.
+	std::thread committer_;
+
+	// Truncates the file to the header of the given generation.
+	void Start(uint64_t generation) {
+		file_ = OpenFile(path_, "wb");
+		Header header{ MAGIC, generation };
+		WriteBytes(file_.get(), &header, sizeof(header));
+		SyncFile(file_.get());
+		num_of_appended_ = 0;
+		num_of_committed_ = 0;
+	}
+
+	void CheckError() const {
+		if (!error_.empty()) {
+			throw std::runtime_error(error_);
+		}
+	}
+
+	void CommitLoop() {
+		std::vector<Record> records;
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			// The interval starts at the first record, so an idle log does not wake up, even with the interval 0.
+			wake_.wait(lock, [this] { return is_stopped_ || is_commit_requested_ || !buffer_.empty(); });
+			wake_.wait_for(lock, commit_interval_, [this] { return is_stopped_ || is_commit_requested_; });
+			is_commit_requested_ = false;
+			if (!buffer_.empty() && error_.empty()) {
+				// The buffer is written without the lock, so appends go on meanwhile.
+				records.swap(buffer_);
+				const uint64_t end = num_of_appended_;
+				std::FILE* file = file_.get();
+				lock.unlock();
+				std::string error;
+				try {
+					const uint32_t size = static_cast<uint32_t>(records.size() * sizeof(Record));
+					FrameHeader frame{ size, Checksum(records.data(), size) };
+					WriteBytes(file, &frame, sizeof(frame));
+					WriteBytes(file, records.data(), size);
+					SyncFile(file);
+				} catch (std::runtime_error& e) {
+					error = e.what();
+				}
+				records.clear();
+				lock.lock();
+				error_ = error;
+				num_of_committed_ = end;
+			}
+			committed_.notify_all();
+			if (is_stopped_ && (buffer_.empty() || !error_.empty())) {
+				return;
+			}
+		}
+	}
+};
+
+// The tree with its mutations made durable. They are logged to <path>.log by WriteAheadLog, and the whole tree
+// is saved to <path>.checkpoint after a bulk load and whenever the log gets long. On opening, the tree is loaded
+// from the checkpoint and the mutations logged since it are replayed. The tree is in memory, so the record of
+// a mutation may be written after the mutation is applied.
+template <typename Tree>
+class DurableTree {
+public:
+	using KeyType = int;
+	// Number of logged mutations after which the tree is checkpointed.
+	static constexpr uint64_t CHECKPOINT_INTERVAL{ 1 << 22 };
+
+	DurableTree(Tree& tree, const std::string& path, std::chrono::milliseconds commit_interval)
+		: tree_(tree), checkpoint_path_(path + ".checkpoint"), generation_(Recover(path + ".log")),
+		log_(path + ".log", commit_interval, generation_) {}
+
+	bool Insert(int key, int value) {
+		if (!tree_.Insert(key, value)) {
+			return false;
+		}
+		Log({ WriteAheadLog::Record::Type::INSERT, key, value });
+		return true;
+	}
+
+	auto Search(int key) {
+		return tree_.Search(key);
+	}
+
+	void BulkLoad(std::vector<KeyValuePair> pairs, double fill_factor = 1.0) {
+		tree_.BulkLoad(std::move(pairs), fill_factor);
+		Checkpoint();
+	}
+
+	SearchResponse Remove(int key) {
+		SearchResponse response = tree_.Remove(key);
+		if (response.is_found) {
+			Log({ WriteAheadLog::Record::Type::DELETE, key, 0 });
+		}
+		return response;
+	}
+
+	template <typename Visit>
+	void Range(int lo, int hi, Visit visit) {
+		tree_.Range(lo, hi, visit);
+	}
+
+	// Saves the tree to the checkpoint and empties the log.
+	void Checkpoint() {
+		log_.Commit();
+		WriteCheckpoint(generation_ + 1);
+		log_.Restart(++generation_);
+	}
+
+	// Whether the tree was recovered from a checkpoint or log records, rather than started empty.
+	bool IsRecovered() const {
+		return is_recovered_;
+	}
+
+private:
+	static constexpr uint64_t CHECKPOINT_MAGIC{ 0x31544e494f504b43 };
+
+	struct CheckpointHeader {
+		uint64_t magic;
+		uint64_t generation;
+		uint64_t num_of_pairs;
+		uint32_t checksum;
+		// Explicit, so no uninitialized padding is written to the file.
+		uint32_t reserved;
+	};
+
+	Tree& tree_;
+	std::string checkpoint_path_;
+	// Set by Recover, so declared before generation_.
+	bool is_recovered_ = false;
+	uint64_t generation_;
+	WriteAheadLog log_;
+
+	void Log(const WriteAheadLog::Record& record) {
+		log_.Append(record);
+		if (log_.GetNumOfRecords() >= CHECKPOINT_INTERVAL) {
+			Checkpoint();
+		}
+	}
+
+	// Loads the checkpoint, if any, and replays the log after it. Returns the generation the new log follows:
+	// if the log had records, they are saved to a new checkpoint first, as the new log replaces the old one.
+	uint64_t Recover(const std::string& log_path) {
+		uint64_t generation = 0;
+		FilePointer file(std::fopen(checkpoint_path_.c_str(), "rb"));
+		if (file != nullptr) {
+			CheckpointHeader header;
+			std::vector<KeyValuePair> pairs;
+			bool is_read = std::fread(&header, sizeof(header), 1, file.get()) == 1 && header.magic == CHECKPOINT_MAGIC;
+			if (is_read) {
+				// The count is checked against the file size before it is allocated.
+				std::error_code error;
+				const uintmax_t file_size = std::filesystem::file_size(checkpoint_path_, error);
+				is_read = !error && header.num_of_pairs <= (file_size - sizeof(header)) / sizeof(KeyValuePair);
+			}
+			if (is_read) {
+				pairs.resize(header.num_of_pairs);
+				is_read = std::fread(pairs.data(), sizeof(KeyValuePair), pairs.size(), file.get()) == pairs.size()
+					&& Checksum(pairs.data(), pairs.size() * sizeof(KeyValuePair)) == header.checksum;
+			}
+			if (!is_read) {
+				throw std::runtime_error("The checkpoint " + checkpoint_path_ + " is damaged.");
+			}
+			generation = header.generation;
+			tree_.BulkLoad(std::move(pairs));
+			is_recovered_ = true;
+		}
+		bool has_records = false;
+		WriteAheadLog::Replay(log_path, generation, [this, &has_records](const WriteAheadLog::Record& record) {
+			if (record.type == WriteAheadLog::Record::Type::INSERT) {
+				tree_.Insert(record.key, record.value);
+			} else {
+				tree_.Remove(record.key);
+			}
+			has_records = true;
+		});
+		if (has_records) {
+			WriteCheckpoint(++generation);
+			is_recovered_ = true;
+		}
+		return generation;
+	}
+
+	// Writes the pairs of the tree to a new file that then replaces the checkpoint, so a crash leaves either
+	// the old checkpoint or the new one.
+	void WriteCheckpoint(uint64_t generation) {
+		std::vector<KeyValuePair> pairs;
+		tree_.Range(std::numeric_limits<int>::min(), std::numeric_limits<int>::max(),
+			[&pairs](const KeyValuePair& pair) { pairs.push_back(pair); });
+		CheckpointHeader header{ CHECKPOINT_MAGIC, generation, pairs.size(),
+			Checksum(pairs.data(), pairs.size() * sizeof(KeyValuePair)), 0 };
+		const std::string new_path = checkpoint_path_ + ".new";
+		{
+			FilePointer file = OpenFile(new_path, "wb");
+			WriteBytes(file.get(), &header, sizeof(header));
+			WriteBytes(file.get(), pairs.data(), pairs.size() * sizeof(KeyValuePair));
+			SyncFile(file.get());
+		}
+		std::filesystem::rename(new_path, checkpoint_path_);
+		SyncDirectory(std::filesystem::absolute(checkpoint_path_).parent_path());
+	}
+};
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "BTree.h"
+
+// Benchmark of the trees on YCSB-style workloads and of ConcurrentBTree with readers running along with a writer.
+// Build it next to main.cpp, e.g.
+// g++ -O2 -std=c++17 -pthread Benchmark.cpp -o Benchmark
+// Usage: Benchmark [number of keys] [number of operations] [seed]
+
+using Clock = std::chrono::steady_clock;
+
+// Values of t the trees are measured with.
+const int T_VALUES[] = { 2, 8, 32, 64, 128 };
+// Latency is measured on every LATENCY_SAMPLE_EVERY-th operation, so the timer barely affects the throughput.
+constexpr size_t LATENCY_SAMPLE_EVERY{ 16 };
+// Skew of the Zipfian keys, as in YCSB.
+constexpr double ZIPF_THETA{ 0.99 };
+// Numbers of reader threads ConcurrentBTree is measured with, along with one writer.
+const size_t READER_COUNTS[] = { 1, 2, 4, 8 };
+// t of the ConcurrentBTree and the share of the reader operations that are range scans of RANGE_WIDTH keys.
+constexpr int CONCURRENT_T{ 32 };
+constexpr size_t RANGE_EVERY{ 16 };
+constexpr int RANGE_WIDTH{ 100 };
+
+// Shares of the operations of a workload; the rest are deletes.
+struct Mix {
+	const char* name;
+	double reads;
+	double inserts;
+};
+
+const Mix MIXES[] = {
+	{ "read-only", 1.0, 0.0 },
+	{ "read-mostly", 0.95, 0.03 },
+	{ "balanced", 0.5, 0.25 },
+	{ "write-heavy", 0.1, 0.45 },
+};
+
+// Zipfian ranks from 0 to n - 1, rank 0 the most popular, by the generator of YCSB (Gray et al., "Quickly
+// generating billion-record synthetic databases").
+class ZipfianGenerator {
+public:
+	ZipfianGenerator(uint64_t n, double theta)
+		: n_(n), theta_(theta), zeta_n_(Zeta(n, theta)), alpha_(1 / (1 - theta)),
+		eta_((1 - std::pow(2.0 / n, 1 - theta)) / (1 - Zeta(2, theta) / zeta_n_)) {}
+
+	template <typename Random>
+	uint64_t operator()(Random& random) {
+		double u = uniform_(random);
+		double uz = u * zeta_n_;
+		if (uz < 1) {
+			return 0;
+		}
+		if (uz < 1 + std::pow(0.5, theta_)) {
+			return 1;
+		}
+		return std::min(n_ - 1, static_cast<uint64_t>(n_ * std::pow(eta_ * u - eta_ + 1, alpha_)));
+	}
+
+private:
+	uint64_t n_;
+	double theta_;
+	double zeta_n_;
+	double alpha_;
+	double eta_;
+	std::uniform_real_distribution<double> uniform_{ 0, 1 };
+
+	static double Zeta(uint64_t n, double theta) {
+		double sum = 0;
+		for (uint64_t i = 1; i <= n; ++i) {
+			sum += 1 / std::pow(static_cast<double>(i), theta);
+		}
+		return sum;
+	}
+};
+
+// FNV-1a hash of the number, to spread the popular Zipfian ranks over the key space, as YCSB does.
+uint64_t Scramble(uint64_t rank) {
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0; i < 8; ++i) {
+		hash = (hash ^ ((rank >> (8 * i)) & 0xFF)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+struct Operation {
+	enum class Type : uint8_t { READ, INSERT, DELETE };
+
+	Type type;
+	int key;
+};
+
+const char* const OPERATION_NAMES[] = { "read", "insert", "delete" };
+constexpr size_t NUM_OF_OPERATION_TYPES{ 3 };
+
+// The pairs loaded before the operations (half of the keys) and the operations themselves.
+struct Workload {
+	std::vector<KeyValuePair> pairs;
+	std::vector<Operation> operations;
+};
+
+Workload GenerateWorkload(size_t num_of_keys, size_t num_of_operations, const Mix& mix, bool is_zipfian, uint64_t seed) {
+	std::mt19937_64 random(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	Workload workload;
+	for (size_t key = 0; key < num_of_keys; ++key) {
+		if (random() % 2 == 0) {
+			workload.pairs.push_back({ static_cast<int>(key), static_cast<int>(random() % 1000000) });
+		}
+	}
+	ZipfianGenerator zipfian(num_of_keys, ZIPF_THETA);
+	workload.operations.reserve(num_of_operations);
+	for (size_t i = 0; i < num_of_operations; ++i) {
+		uint64_t key = is_zipfian ? Scramble(zipfian(random)) % num_of_keys : random() % num_of_keys;
+		double share = uniform(random);
+		Operation::Type type = share < mix.reads ? Operation::Type::READ
+			: share < mix.reads + mix.inserts ? Operation::Type::INSERT : Operation::Type::DELETE;
+		workload.operations.push_back({ type, static_cast<int>(key) });
+	}
+	return workload;
+}
+
+// Latency samples in nanoseconds.
+class Latencies {
+public:
+	void Add(Clock::duration duration) {
+		samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	}
+
+	// Value below which the given share of the samples is.
+	long long GetPercentile(double share) {
+		if (samples_.empty()) {
+			return 0;
+		}
+		size_t index = std::min(samples_.size() - 1, static_cast<size_t>(share * samples_.size()));
+		std::nth_element(samples_.begin(), samples_.begin() + index, samples_.end());
+		return samples_[index];
+	}
+
+private:
+	std::vector<long long> samples_;
+};
+
+// std::map and std::unordered_map with the interface of the trees, the baselines.
+template <typename Map>
+class MapTree {
+public:
+	bool Insert(int key, int value) {
+		return map_.emplace(key, value).second;
+	}
+
+	SearchResponse Search(int key) const {
+		auto it = map_.find(key);
+		return it == map_.end() ? SearchResponse{ false, 0 } : SearchResponse{ true, it->second };
+	}
+
+	void BulkLoad(const std::vector<KeyValuePair>& pairs) {
+		map_.clear();
+		for (const KeyValuePair& pair : pairs) {
+			map_.emplace(pair.key, pair.value);
+		}
+	}
+
+	SearchResponse Remove(int key) {
+		auto it = map_.find(key);
+		if (it == map_.end()) {
+			return { false, 0 };
+		}
+		SearchResponse response{ true, it->second };
+		map_.erase(it);
+		return response;
+	}
+
+private:
+	Map map_;
+};
+
+double GetSeconds(Clock::duration duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+void PrintHeader() {
+	std::printf("%-16s %6s", "tree", "Mops");
+	for (const char* name : OPERATION_NAMES) {
+		std::printf("  %10s %5s %6s", (std::string(name) + " p50").c_str(), "p99", "p99.9");
+	}
+	std::printf("  %6s %8s %5s %8s %8s %8s %7s\n", "height", "nodes", "fill", "splits/k", "merges/k", "borrow/k", "nodes/op");
+}
+
+template <typename Tree>
+void PrintCounters(const Tree&) {
+	std::printf("\n");
+}
+
+void PrintCounters(const BTree<>& tree) {
+	const BTreeCounters& counters = tree.GetCounters();
+	BTreeShape shape = tree.GetShape();
+	double thousands = counters.operations / 1000.0;
+	std::printf("  %6d %8zu %5.2f %8.2f %8.2f %8.2f %7.2f\n", shape.height, shape.num_of_nodes, shape.average_fill,
+		counters.splits / thousands, counters.merges / thousands, counters.borrows / thousands,
+		static_cast<double>(counters.nodes_visited) / counters.operations);
+}
+
+// Loads the pairs of the workload, runs its operations and prints the throughput, the latencies of each type of
+// operation and, for BTree, its counters. Returns a checksum of the answers, which must be the same for all trees.
+template <typename Tree>
+uint64_t RunWorkload(const std::string& name, Tree& tree, const Workload& workload) {
+	tree.BulkLoad(workload.pairs);
+	if constexpr (std::is_same<Tree, BTree<>>::value) {
+		tree.ResetCounters();
+	}
+	Latencies latencies[NUM_OF_OPERATION_TYPES];
+	uint64_t checksum = 0;
+	Clock::time_point begin = Clock::now();
+	for (size_t i = 0; i < workload.operations.size(); ++i) {
+		const Operation& operation = workload.operations[i];
+		bool sampled = i % LATENCY_SAMPLE_EVERY == 0;
+		Clock::time_point start = sampled ? Clock::now() : begin;
+		SearchResponse response{ false, 0 };
+		switch (operation.type) {
+		case Operation::Type::READ:
+			response = tree.Search(operation.key);
+			break;
+		case Operation::Type::INSERT:
+			response.is_found = tree.Insert(operation.key, static_cast<int>(i));
+			break;
+		case Operation::Type::DELETE:
+			response = tree.Remove(operation.key);
+			break;
+		}
+		if (sampled) {
+			latencies[static_cast<size_t>(operation.type)].Add(Clock::now() - start);
+		}
+		checksum = checksum * 31 + (response.is_found ? static_cast<uint64_t>(response.value) + 1 : 0);
+	}
+	Clock::duration time = Clock::now() - begin;
+
+	std::printf("%-16s %6.2f", name.c_str(), workload.operations.size() / GetSeconds(time) / 1e6);
+	for (Latencies& type_latencies : latencies) {
+		std::printf("  %10lld %5lld %6lld", type_latencies.GetPercentile(0.5), type_latencies.GetPercentile(0.99),
+			type_latencies.GetPercentile(0.999));
+	}
+	PrintCounters(tree);
+	return checksum;
+}
+
+/// <summary>
+/// Runs READER_COUNTS reader threads against a ConcurrentBTree while one writer applies a stream of inserts and
+/// removes, and prints the throughput of both. The even keys are loaded first and the writer only touches the odd
+/// ones, so the readers know what they must see: every even key with its value, and range scans in key order.
+/// When the writer is done, the contents of the tree and the answers of the writer are compared with the same
+/// stream applied to std::map on one thread. Returns the number of mismatches.
+/// </summary>
+size_t RunConcurrentSweep(size_t num_of_keys, size_t num_of_operations, uint64_t seed) {
+	std::vector<KeyValuePair> pairs;
+	for (size_t key = 0; key < num_of_keys; key += 2) {
+		pairs.push_back({ static_cast<int>(key), static_cast<int>(key) * 3 });
+	}
+	std::mt19937_64 random(seed);
+	std::vector<Operation> writes(num_of_operations);
+	for (Operation& write : writes) {
+		write.type = random() % 2 == 0 ? Operation::Type::INSERT : Operation::Type::DELETE;
+		write.key = static_cast<int>(random() % num_of_keys) | 1;
+	}
+
+	// The expected contents and answers.
+	std::map<int, int> expected_map;
+	for (const KeyValuePair& pair : pairs) {
+		expected_map.emplace(pair.key, pair.value);
+	}
+	uint64_t expected_checksum = 0;
+	for (size_t i = 0; i < writes.size(); ++i) {
+		bool is_done = writes[i].type == Operation::Type::INSERT
+			? expected_map.emplace(writes[i].key, static_cast<int>(i)).second : expected_map.erase(writes[i].key) != 0;
+		expected_checksum = expected_checksum * 31 + (is_done ? 1 : 0);
+	}
+
+	std::printf("\nConcurrentBTree t=%d: %zu keys, %zu writes by one writer, 1 of %zu reads is a range of %d keys\n",
+		CONCURRENT_T, num_of_keys, num_of_operations, RANGE_EVERY, RANGE_WIDTH);
+	std::printf("%-8s %10s %12s %10s %8s %8s\n", "readers", "read Mops", "Mops/reader", "write Mops", "errors", "result");
+	size_t num_of_mismatches = 0;
+	for (size_t num_of_readers : READER_COUNTS) {
+		ConcurrentBTree tree(CONCURRENT_T);
+		tree.BulkLoad(pairs);
+		std::atomic<bool> is_writing{ true };
+		std::atomic<size_t> num_of_reads{ 0 }, num_of_errors{ 0 };
+		uint64_t checksum = 0;
+
+		auto read = [&](size_t reader) {
+			std::mt19937_64 reader_random(seed + reader + 1);
+			size_t reads = 0, errors = 0;
+			std::vector<int> keys;
+			while (is_writing.load(std::memory_order_relaxed)) {
+				int key = static_cast<int>(reader_random() % num_of_keys);
+				if (reads % RANGE_EVERY == 0) {
+					keys.clear();
+					tree.Range(key, key + RANGE_WIDTH - 1, [&keys](const KeyValuePair& pair) { keys.push_back(pair.key); });
+					// All the even keys of the range, in order, with odd ones between them.
+					int next_even = (key + 1) / 2 * 2;
+					for (size_t i = 0; i < keys.size(); ++i) {
+						errors += keys[i] < key || keys[i] >= key + RANGE_WIDTH || (i > 0 && keys[i] <= keys[i - 1]) ? 1 : 0;
+						if (keys[i] % 2 == 0) {
+							errors += keys[i] != next_even ? 1 : 0;
+							next_even = keys[i] + 2;
+						}
+					}
+					errors += next_even < std::min(key + RANGE_WIDTH, static_cast<int>(num_of_keys)) ? 1 : 0;
+				}
+				else {
+					SearchResponse response = tree.Search(key);
+					errors += key % 2 == 0 && (!response.is_found || response.value != key * 3) ? 1 : 0;
+				}
+				++reads;
+			}
+			num_of_reads += reads;
+			num_of_errors += errors;
+		};
+
+		std::vector<std::thread> readers;
+		for (size_t i = 0; i < num_of_readers; ++i) {
+			readers.emplace_back(read, i);
+		}
+		Clock::time_point begin = Clock::now();
+		for (size_t i = 0; i < writes.size(); ++i) {
+			bool is_done = writes[i].type == Operation::Type::INSERT ? tree.Insert(writes[i].key, static_cast<int>(i))
+				: tree.Remove(writes[i].key).is_found;
+			checksum = checksum * 31 + (is_done ? 1 : 0);
+		}
+		Clock::duration time = Clock::now() - begin;
+		is_writing = false;
+		for (std::thread& reader : readers) {
+			reader.join();
+		}
+
+		std::vector<KeyValuePair> contents;
+		tree.Range(std::numeric_limits<int>::min(), std::numeric_limits<int>::max(),
+			[&contents](const KeyValuePair& pair) { contents.push_back(pair); });
+		bool is_same = checksum == expected_checksum && contents.size() == expected_map.size()
+			&& std::equal(contents.begin(), contents.end(), expected_map.begin(),
+				[](const KeyValuePair& pair, const std::pair<const int, int>& expected) {
+					return pair.key == expected.first && pair.value == expected.second;
+				});
+		num_of_mismatches += (is_same ? 0 : 1) + (num_of_errors != 0 ? 1 : 0);
+		double read_throughput = num_of_reads / GetSeconds(time) / 1e6;
+		std::printf("%-8zu %10.2f %12.2f %10.2f %8zu %8s\n", num_of_readers, read_throughput,
+			read_throughput / num_of_readers, writes.size() / GetSeconds(time) / 1e6, num_of_errors.load(),
+			is_same ? "same" : "DIFFERS");
+	}
+	return num_of_mismatches;
+}
+
+int main(int argc, char* argv[]) {
+	size_t num_of_keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : size_t{ 1 } << 20;
+	size_t num_of_operations = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : size_t{ 1 } << 21;
+	uint64_t seed = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1;
+	if (num_of_keys < 2 || num_of_keys > static_cast<size_t>(std::numeric_limits<int>::max()) || num_of_operations == 0) {
+		std::fprintf(stderr, "Usage: Benchmark [number of keys] [number of operations] [seed]\n");
+		return 1;
+	}
+
+	size_t num_of_mismatches = 0;
+	for (bool is_zipfian : { false, true }) {
+		for (const Mix& mix : MIXES) {
+			Workload workload = GenerateWorkload(num_of_keys, num_of_operations, mix, is_zipfian, seed);
+			std::printf("\n%s keys, %s: %zu keys, %zu operations, latencies in ns\n", is_zipfian ? "Zipfian" : "uniform",
+				mix.name, num_of_keys, num_of_operations);
+			PrintHeader();
+			uint64_t expected;
+			{
+				MapTree<std::map<int, int>> tree;
+				expected = RunWorkload("std::map", tree, workload);
+			}
+			{
+				MapTree<std::unordered_map<int, int>> tree;
+				num_of_mismatches += RunWorkload("unordered_map", tree, workload) != expected ? 1 : 0;
+			}
+			for (int t : T_VALUES) {
+				BTree<> tree(t);
+				num_of_mismatches += RunWorkload("BTree t=" + std::to_string(t), tree, workload) != expected ? 1 : 0;
+			}
+			for (int t : T_VALUES) {
+				BPlusTree tree(t);
+				num_of_mismatches += RunWorkload("B+ tree t=" + std::to_string(t), tree, workload) != expected ? 1 : 0;
+			}
+		}
+	}
+
+	num_of_mismatches += RunConcurrentSweep(num_of_keys, num_of_operations, seed);
+
+	if (num_of_mismatches != 0) {
+		std::fprintf(stderr, "%zu runs answered differently from std::map!\n", num_of_mismatches);
+		return 1;
+	}
+	return 0;
+}
@@ -1,346 +1,292 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
-//  Ը, 196
-
-class BTree {
-private:
-	struct KeyValuePair {
-		int key;
-		int value;
-	};
-
-	// Upper-bound binary search for vector of pairs. 
-	static int BinarySearch(const std::vector<KeyValuePair>& source, int key) {
-		if (source.empty()) {
-			return 0;
-		}
-		if (source.back().key < key) {
-			return source.size();
-		}
-		int left = -1, right = source.size();
-		while (right - left > 1) {
-			int middle = (left + right) / 2;
-			if (source[middle].key == key) {
-				return middle;
-			} else if (source[middle].key < key) {
-				left = middle;
-			} else {
-				right = middle;
-			}
-		}
-		return right;
-	}
-
-	struct Node {
-		Node() = default;
+#include "BTree.h"
 
-		// Makes a node from right part of given node. [center is actually t - 1]
-		Node(Node* node, int center) : is_leaf(node->is_leaf) {
-			// Taking second half of the keys.
-			payload.insert(payload.end(), node->payload.begin() + (center + 1), node->payload.end());
-			if (!node->is_leaf) {
-				children.insert(children.end(), node->children.begin() + (center + 1), node->children.end());
-			}
-		}
-
-		bool HasKeyAt(int index, int key) {
-			return 0 <= index && index < payload.size() && payload[index].key == key;
-		}
-
-		void InsertChild(int index, Node* child) {
-			children.insert(children.begin() + index, child);
-		}
-
-		void InsertKeyValue(int index, KeyValuePair pair) {
-			payload.insert(payload.begin() + index, pair);
-		}
-
-		KeyValuePair GetPredecessor(int index) {
-			Node* current = children[index];
-			while (!current->is_leaf) {
-				current = current->children.back();
-			}
-			return current->payload.back();
-		}
-
-		KeyValuePair GetSuccessor(int index) {
-			Node* current = children[index + 1];
-			while (!current->is_leaf) {
-				current = current->children.front();
-			}
-
-			return current->payload.front();
-		}
-
-		void TakeFromPrevious(int child_index) {
-			Node* child = children[child_index];
-			Node* prev_sibling = children[child_index - 1];
-
-			child->InsertKeyValue(0, payload[child_index - 1]);
-
-			if (!child->is_leaf) {
-				child->InsertChild(0, prev_sibling->children.back());
-				prev_sibling->children.pop_back();
-			}
-
-			payload[child_index - 1] = prev_sibling->payload.back();
-
-			prev_sibling->payload.pop_back();
-		}
-
-		void TakeFromNext(int child_index) {
-			Node* child = children[child_index];
-			Node* next = children[child_index + 1];
-
-			child->payload.push_back(payload[child_index]);
-
-			if (!child->is_leaf) {
-				child->children.push_back(next->children[0]);
-			}
-
-			payload[child_index] = next->payload[0];
-
-			// Remove the first element.
-			next->payload.erase(next->payload.begin());
-			if (!next->is_leaf) {
-				next->children.erase(next->children.begin());
-			}
-		}
-
-		bool is_leaf = true;
-		std::vector<Node*> children;
-		std::vector<KeyValuePair> payload;
-	};
-
-public:
-	struct SearchResponse {
-		bool is_found;
-		int value;
-	};
-
-	explicit BTree(int min_branching_degree) : min_branching_degree_(min_branching_degree), root_(new Node()) {}
-
-	~BTree() {
-		delete root_;
-	}
-
-	// Inserts the given key-value pair into the tree. If the key already present, returns false and does nothing.
-	bool Insert(int key, int value) {
-		if (Search(key).is_found) {
-			return false;
-		}
-
-		Node* root = root_;
-		if (root_->payload.size() == (2 * min_branching_degree_ - 1)) {
-			Node* new_root = new Node();
-			root_ = new_root;
-			new_root->is_leaf = false;
-			new_root->children.push_back(root);
-			SplitChild(new_root, 0);
-			InsertNonFull(new_root, key, value);
-		} else {
-			InsertNonFull(root, key, value);
-		}
-
-		return true;
-	}
+//  Ը, 196
 
-	SearchResponse Search(int key) {
-		return Search(root_, key);
+// Reads "key value" pairs till the end of the stream.
+template <typename Key>
+std::vector<BasicKeyValuePair<Key, int>> ReadPairs(std::istream& in) {
+	std::vector<BasicKeyValuePair<Key, int>> pairs;
+	BasicKeyValuePair<Key, int> pair;
+	while (in >> pair.key >> pair.value) {
+		pairs.push_back(pair);
 	}
-
-	SearchResponse Remove(int key) {
-		auto res = Remove(root_, key);
-		if (root_->payload.empty()) {
-			Node* tmp = root_;
-			root_ = root_->is_leaf ? new Node() : root_->children.front();
-			delete tmp;
-		}
-		return res;
+	if (!in.eof()) {
+		throw std::runtime_error("Unexpected format of the pairs to load.");
 	}
+	return pairs;
+}
 
-private:
-	Node* root_;
-	int min_branching_degree_;
-
-	// Inserts key-value in the non-full node.
-	void InsertNonFull(Node* node, int key, int value) {
-		int i = BinarySearch(node->payload, key);
-		if (node->is_leaf) {
-			node->InsertKeyValue(i, { key, value });
-			// DISK WRITE node
-		} else {
-			// DISK READ node.children[i]
-			if (node->children[i]->payload.size() == (2 * min_branching_degree_ - 1)) {
-				SplitChild(node, i);
-				if (key > node->payload[i].key) {
-					++i;
-				}
+// Runs the commands of the input. "range lo hi" prints the pairs with keys from lo to hi as "key:value"
+// separated by spaces, on one line, or "null" if there are none.
+template <typename Tree>
+void Run(std::istream& in, std::ostream& out, Tree& tree) {
+	std::string command;
+	while (in >> command) {
+		typename Tree::KeyType key;
+		in >> key;
+		if (command == "find") {
+			auto search_response = tree.Search(key);
+			if (search_response.is_found) {
+				out << search_response.value << "\n";
+			} else {
+				out << "null" << "\n";
 			}
-			InsertNonFull(node->children[i], key, value);
-		}
-	}
-
-	// Searches for the key in the given node.
-	SearchResponse Search(Node* node, int key) {
-		int key_pos = BinarySearch(node->payload, key);
-		// If we found the key.
-		if (node->HasKeyAt(key_pos, key)) {
-			return SearchResponse{ true, node->payload[key_pos].value };
-		} else if (node->is_leaf) {
-			return SearchResponse{ false, 0 };
-		} else {
-			return Search(node->children[key_pos], key);
-		}
-	}
-
-	// Removes the given key from the node or its descendant.
-	SearchResponse Remove(Node* node, int key) {
-		int key_pos = BinarySearch(node->payload, key);
-		// If we have such a key in this node, we can delete it.
-		if (node->HasKeyAt(key_pos, key)) {
-			int value = node->payload[key_pos].value;
-			if (node->is_leaf) {
-				RemoveFromLeaf(node, key_pos);
+		} else if (command == "insert") {
+			int value;
+			in >> value;
+			bool insert_response = tree.Insert(key, value);
+			out << (insert_response ? "true" : "false") << "\n";
+		} else if (command == "delete") {
+			auto delete_response = tree.Remove(key);
+			if (delete_response.is_found) {
+				out << delete_response.value << "\n";
 			} else {
-				RemoveFromNonLeaf(node, key_pos);
+				out << "null" << "\n";
 			}
-			return { true, value };
+		} else if (command == "range") {
+			typename Tree::KeyType hi;
+			in >> hi;
+			bool is_empty = true;
+			tree.Range(key, hi, [&out, &is_empty](const auto& pair) {
+				out << (is_empty ? "" : " ") << pair.key << ':' << pair.value;
+				is_empty = false;
+			});
+			out << (is_empty ? "null" : "") << "\n";
 		} else {
-			// If it is a leaf, there are no descendants.
-			if (node->is_leaf) {
-				return { false, 0 };
-			}
-
-			// Else we are going to look in descendants.
-			bool was_last = key_pos == node->payload.size();
-
-			if (node->children[key_pos]->payload.size() < min_branching_degree_) {
-				Fill(node, key_pos);
-			}
-
-			if (was_last && key_pos > node->payload.size()) {
-				return Remove(node->children[key_pos - 1], key);
-			}
-			return Remove(node->children[key_pos], key);
+			throw std::runtime_error("Unknown command \'" + command + "\'");
 		}
 	}
+}
 
-	// Removes the given key from the node which happened to be a leaf.
-	static void RemoveFromLeaf(Node* node, int index) {
-		node->payload.erase(node->payload.begin() + index);
-	}
+// A find, insert or delete of a batch.
+struct BatchCommand {
+	enum class Type { FIND, INSERT, DELETE };
 
-	// Removes the given key from non-leaf node.
-	void RemoveFromNonLeaf(Node* node, int index) {
-		if (node->children[index]->payload.size() > min_branching_degree_) {
-			auto pred = node->GetPredecessor(index);
-			node->payload[index] = pred;
-			Remove(node->children[index], pred.key);
-		} else if (node->children[index + 1]->payload.size() > min_branching_degree_) {
-			auto succ = node->GetSuccessor(index);
-			node->payload[index] = succ;
-			Remove(node->children[index + 1], succ.key);
-		} else {
-			int key = node->payload[index].key;
-			Merge(node, index);
-			Remove(node->children[index], key);
-		}
-	}
+	Type type;
+	int key;
+	int value;
+};
 
-	// Splitting the child_id'th child of the node into two parts.
-	static void SplitChild(Node* node, int child_id) {
-		int center_key_id = node->children[child_id]->payload.size() / 2;
-		auto left = node->children[child_id];
-		auto right = new Node(left, center_key_id);
+// An answer to a command of a batch: the value, "null", "true" or "false".
+struct BatchAnswer {
+	enum class Type { VALUE, NONE, TRUE, FALSE };
 
-		node->InsertChild(child_id + 1, right);
-		node->InsertKeyValue(child_id, left->payload[center_key_id]);
+	Type type;
+	int value;
+};
 
-		left->payload.resize(center_key_id);
-		if (!left->is_leaf) {
-			left->children.resize(center_key_id + 1);
-		}
+// Runs the commands of the batch and prints the answers in their order. Commands of different keys do not depend
+// on each other, so the commands are grouped by key, the keys are looked up in the tree at once, and then the
+// commands of each key are played against what was found. The tree is changed after that, at most once
+// for a key: its value is replaced in place, or it is inserted or removed.
+template <typename Tree>
+void RunBatch(const std::vector<BatchCommand>& batch, std::ostream& out, Tree& tree) {
+	// Commands of a key keep their order.
+	std::vector<size_t> order(batch.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
 	}
-
-	// Merges the [index]'th and [index + 1]'th children of the node.
-	static void Merge(Node* node, int index) {
-		Node* child = node->children[index];
-		Node* sibling = node->children[index + 1];
-
-		child->payload.push_back(node->payload[index]);
-
-		// Adding all sibling's payload to the child.
-		child->payload.insert(child->payload.end(), sibling->payload.begin(), sibling->payload.end());
-
-		if (!child->is_leaf) {
-			child->children.insert(child->children.end(), sibling->children.begin(), sibling->children.end());
+	std::stable_sort(order.begin(), order.end(), [&batch](size_t left, size_t right) {
+		return batch[left].key < batch[right].key;
+	});
+	std::vector<int> keys;
+	// Commands of keys[i] are order[group_begins[i]], ..., order[group_begins[i + 1] - 1].
+	std::vector<size_t> group_begins;
+	for (size_t i = 0; i < order.size(); ++i) {
+		if (keys.empty() || batch[order[i]].key != keys.back()) {
+			keys.push_back(batch[order[i]].key);
+			group_begins.push_back(i);
 		}
-
-		node->payload.erase(node->payload.begin() + index);
-		node->children.erase(node->children.begin() + (index + 1));
-
-		delete sibling;
 	}
-
-	void Fill(Node* node, int index) const {
-		if (index != 0 && CanTakeFrom(node->children[index - 1])) {
-			node->TakeFromPrevious(index);
-		} else if (index != node->payload.size() && CanTakeFrom(node->children[index + 1])) {
-			node->TakeFromNext(index);
-		} else {
-			if (index != node->payload.size()) {
-				Merge(node, index);
+	group_begins.push_back(order.size());
+
+	std::vector<BatchAnswer> answers(batch.size());
+	std::vector<KeyValuePair> to_insert;
+	std::vector<int> to_remove;
+	tree.VisitSorted(keys.data(), keys.size(), [&](size_t i, int* value) {
+		bool is_present = value != nullptr;
+		int current = is_present ? *value : 0;
+		for (size_t j = group_begins[i]; j < group_begins[i + 1]; ++j) {
+			const BatchCommand& command = batch[order[j]];
+			BatchAnswer& answer = answers[order[j]];
+			if (command.type == BatchCommand::Type::FIND) {
+				answer = is_present ? BatchAnswer{ BatchAnswer::Type::VALUE, current } : BatchAnswer{ BatchAnswer::Type::NONE, 0 };
+			} else if (command.type == BatchCommand::Type::INSERT) {
+				answer = { is_present ? BatchAnswer::Type::FALSE : BatchAnswer::Type::TRUE, 0 };
+				if (!is_present) {
+					is_present = true;
+					current = command.value;
+				}
 			} else {
-				Merge(node, index - 1);
+				answer = is_present ? BatchAnswer{ BatchAnswer::Type::VALUE, current } : BatchAnswer{ BatchAnswer::Type::NONE, 0 };
+				is_present = false;
 			}
 		}
+		if (value != nullptr && is_present) {
+			*value = current;
+		} else if (value != nullptr) {
+			to_remove.push_back(keys[i]);
+		} else if (is_present) {
+			to_insert.push_back({ keys[i], current });
+		}
+	});
+	// The keys were visited in order, so both lists are sorted, and each takes one more shared descent.
+	tree.RemoveSorted(to_remove.data(), to_remove.size());
+	tree.InsertSorted(to_insert.data(), to_insert.size());
+
+	for (const BatchAnswer& answer : answers) {
+		if (answer.type == BatchAnswer::Type::VALUE) {
+			out << answer.value << "\n";
+		} else if (answer.type == BatchAnswer::Type::NONE) {
+			out << "null" << "\n";
+		} else {
+			out << (answer.type == BatchAnswer::Type::TRUE ? "true" : "false") << "\n";
+		}
 	}
+}
 
-	// Indicates whether we can take payload from the node.
-	bool CanTakeFrom(const Node* node) const {
-		return node->payload.size() > min_branching_degree_;
-	}
-};
-
-void Run(std::istream& in, std::ostream& out, int t) {
-	BTree tree(t);
+// Runs the commands of the input as Run does, but the finds, inserts and deletes a batch of up to BATCH_SIZE
+// commands at a time (see RunBatch). A range ends the batch and runs alone.
+template <typename Tree>
+void RunBatched(std::istream& in, std::ostream& out, Tree& tree) {
+	constexpr size_t BATCH_SIZE{ 1 << 12 };
+	std::vector<BatchCommand> batch;
+	batch.reserve(BATCH_SIZE);
 	std::string command;
 	while (in >> command) {
 		int key;
 		in >> key;
 		if (command == "find") {
-			auto search_response = tree.Search(key);
-			if (search_response.is_found) {
-				out << search_response.value << "\n";
-			} else {
-				out << "null" << "\n";
-			}
+			batch.push_back({ BatchCommand::Type::FIND, key, 0 });
 		} else if (command == "insert") {
 			int value;
 			in >> value;
-			bool insert_response = tree.Insert(key, value);
-			out << (insert_response ? "true" : "false") << "\n";
+			batch.push_back({ BatchCommand::Type::INSERT, key, value });
 		} else if (command == "delete") {
-			auto delete_response = tree.Remove(key);
-			if (delete_response.is_found) {
-				out << delete_response.value << "\n";
-			} else {
-				out << "null" << "\n";
-			}
+			batch.push_back({ BatchCommand::Type::DELETE, key, 0 });
+		} else if (command == "range") {
+			int hi;
+			in >> hi;
+			RunBatch(batch, out, tree);
+			batch.clear();
+			bool is_empty = true;
+			tree.Range(key, hi, [&out, &is_empty](KeyValuePair pair) {
+				out << (is_empty ? "" : " ") << pair.key << ':' << pair.value;
+				is_empty = false;
+			});
+			out << (is_empty ? "null" : "") << "\n";
 		} else {
 			throw std::runtime_error("Unknown command \'" + command + "\'");
 		}
+		if (batch.size() == BATCH_SIZE) {
+			RunBatch(batch, out, tree);
+			batch.clear();
+		}
+	}
+	RunBatch(batch, out, tree);
+}
+
+// Loads the tree with the pairs of the given file, if any, and runs the commands of the input with the given
+// function (Run or RunBatched).
+template <typename Tree>
+int Process(Tree& tree, const char* input_path, const char* output_path, const char* pairs_path, double fill_factor,
+	void (*run)(std::istream&, std::ostream&, Tree&) = Run<Tree>) {
+	if (pairs_path != nullptr) {
+		std::ifstream pairs(pairs_path);
+		if (!pairs.is_open()) {
+			std::cerr << "Cannot open the file of pairs!";
+			return 1;
+		}
+		tree.BulkLoad(ReadPairs<typename Tree::KeyType>(pairs), fill_factor);
+	}
+	std::ifstream in(input_path);
+	std::ofstream out(output_path);
+	if (in.is_open() && out.is_open()) {
+		run(in, out, tree);
+		in.close();
+		out.close();
+	} else {
+		std::cerr << "Cannot open one of the files provided!";
+		return 1;
 	}
+	return 0;
+}
+
+// Process with the tree made durable by DurableTree, which first recovers it from the files at the given path.
+// The pairs only seed a new tree: a recovered one already holds them (or what became of them), and loading them
+// again would replace its history.
+template <typename Tree>
+int ProcessDurably(Tree& tree, const char* path, std::chrono::milliseconds commit_interval, const char* input_path,
+	const char* output_path, const char* pairs_path, double fill_factor) {
+	DurableTree<Tree> durable_tree(tree, path, commit_interval);
+	return Process(durable_tree, input_path, output_path, durable_tree.IsRecovered() ? nullptr : pairs_path,
+		fill_factor);
 }
 
+// Usage: main [-durable path interval] [-batch] [-bplus | -concurrent | -paged file budget | -keys type]
+// t input output [pairs [fill factor]].
+// With -bplus the pairs are kept in a B+ tree, with -concurrent in a ConcurrentBTree, with -paged in a tree
+// in the given file with a buffer pool of the given budget in KiB. With -keys the keys of BTree are of the given
+// type, int64 or string, instead of int. With -batch the commands are run in batches by RunBatched (for BTree
+// with int keys and the B+ tree only). With -durable the mutations of BTree, the B+ tree or ConcurrentBTree (with
+// int keys, not in batches) survive restarts: the tree is kept in the files <path>.checkpoint and <path>.log and
+// the log is committed every given number of milliseconds.
+// The tree is first bulk loaded with the "key value" pairs of the given file, if any (with -durable, only if nothing
+// was recovered).
 int main(int argc, char* argv[]) {
-	if (argc != 4) {
-		std::cerr << "You must provide parameter t, input file path and output file path.";
+	const char* durable_path = nullptr;
+	std::chrono::milliseconds commit_interval(0);
+	if (argc > 3 && std::string(argv[1]) == "-durable") {
+		durable_path = argv[2];
+		commit_interval = std::chrono::milliseconds(std::stoul(argv[3]));
+		argv += 3;
+		argc -= 3;
+	}
+	bool is_batched = argc > 1 && std::string(argv[1]) == "-batch";
+	if (is_batched) {
+		++argv;
+		--argc;
+	}
+	std::string mode = argc > 1 ? argv[1] : "";
+	if (is_batched && (mode == "-concurrent" || mode == "-paged" || mode == "-keys")) {
+		std::cerr << "Only BTree with int keys and the B+ tree run commands in batches.";
+		return 1;
+	}
+	const char* page_file_path = nullptr;
+	size_t memory_budget = 0;
+	if (durable_path != nullptr && (is_batched || mode == "-paged" || mode == "-keys")) {
+		std::cerr << "Only BTree, the B+ tree and ConcurrentBTree with int keys are made durable, and not in batches.";
+		return 1;
+	}
+	std::string key_type = "int";
+	if (mode == "-bplus" || mode == "-concurrent") {
+		++argv;
+		--argc;
+	} else if (mode == "-paged" && argc > 3) {
+		page_file_path = argv[2];
+		memory_budget = std::stoul(argv[3]) * 1024;
+		argv += 3;
+		argc -= 3;
+	} else if (mode == "-keys" && argc > 2) {
+		key_type = argv[2];
+		if (key_type != "int64" && key_type != "string") {
+			std::cerr << "Keys must be int64 or string.";
+			return 1;
+		}
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc < 4 || argc > 6) {
+		std::cerr << "You must provide parameter t, input file path and output file path "
+			"(and optionally a file of pairs to load and the fill factor).";
 		return 1;
 	}
 	int t = std::stoi(argv[1]);
@@ -348,14 +294,44 @@ int main(int argc, char* argv[]) {
 		std::cerr << "Parameter t must be at least 2.";
 		return 1;
 	}
-	std::ifstream in(argv[2]);
-	std::ofstream out(argv[3]);
-	if (in.is_open() && out.is_open()) {
-		Run(in, out, t);
-		in.close();
-		out.close();
-	} else {
-		std::cerr << "Cannot open one of the files provided!";
+	double fill_factor = argc == 6 ? std::stod(argv[5]) : 1.0;
+	if (fill_factor <= 0 || fill_factor > 1) {
+		std::cerr << "Fill factor must be in (0, 1].";
+		return 1;
+	}
+	const char* pairs_path = argc >= 5 ? argv[4] : nullptr;
+	try {
+		if (page_file_path != nullptr) {
+			PagedBTree tree(page_file_path, t, memory_budget);
+			return Process(tree, argv[2], argv[3], pairs_path, fill_factor);
+		} else if (durable_path != nullptr) {
+			if (mode == "-bplus") {
+				BPlusTree tree(t);
+				return ProcessDurably(tree, durable_path, commit_interval, argv[2], argv[3], pairs_path, fill_factor);
+			} else if (mode == "-concurrent") {
+				ConcurrentBTree tree(t);
+				return ProcessDurably(tree, durable_path, commit_interval, argv[2], argv[3], pairs_path, fill_factor);
+			}
+			BTree<> tree(t);
+			return ProcessDurably(tree, durable_path, commit_interval, argv[2], argv[3], pairs_path, fill_factor);
+		} else if (mode == "-bplus") {
+			BPlusTree tree(t);
+			return Process(tree, argv[2], argv[3], pairs_path, fill_factor,
+				is_batched ? RunBatched<BPlusTree> : Run<BPlusTree>);
+		} else if (mode == "-concurrent") {
+			ConcurrentBTree tree(t);
+			return Process(tree, argv[2], argv[3], pairs_path, fill_factor);
+		} else if (key_type == "int64") {
+			BTree<int64_t> tree(t);
+			return Process(tree, argv[2], argv[3], pairs_path, fill_factor);
+		} else if (key_type == "string") {
+			BTree<std::string> tree(t);
+			return Process(tree, argv[2], argv[3], pairs_path, fill_factor);
+		}
+		BTree<> tree(t);
+		return Process(tree, argv[2], argv[3], pairs_path, fill_factor, is_batched ? RunBatched<BTree<>> : Run<BTree<>>);
+	} catch (std::runtime_error& e) {
+		std::cerr << e.what();
 		return 1;
 	}
 }
@@ -0,0 +1,418 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RTREE_HAS_SSE2 1
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Number of children of a node (and of entries of a leaf). A block of this many boxes is tested against the query
+// at once, so it is a multiple of the four boxes an AVX2 compare covers.
+constexpr size_t RTREE_FANOUT{ 8 };
+
+// Axis-aligned box, borders included.
+struct Box {
+	double min_x;
+	double min_y;
+	double max_x;
+	double max_y;
+};
+
+inline unsigned CountTrailingZeros(unsigned mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<unsigned>(index);
+#else
+	return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Position of the cell (x, y) of the 2^16 x 2^16 grid along the Hilbert curve.
+inline uint32_t HilbertIndex(uint32_t x, uint32_t y) {
+	const uint32_t side = 1u << 16;
+	uint32_t index = 0;
+	for (uint32_t s = side / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) != 0 ? 1 : 0;
+		uint32_t ry = (y & s) != 0 ? 1 : 0;
+		index += s * s * ((3 * rx) ^ ry);
+		// Turning the quadrant so that the curve in it starts and ends where the curve of the whole grid does.
+		if (ry == 0) {
+			if (rx == 1) {
+				x = side - 1 - x;
+				y = side - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return index;
+}
+
+// Read-only view of a whole file mapped into memory. The same as the MappedFile of the cuckoo filter project,
+// copied because the projects are built separately and share no headers.
+class MappedFile {
+public:
+	explicit MappedFile(const char* path) {
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		size_ = static_cast<size_t>(size.QuadPart);
+		if (size_ > 0) {
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping != nullptr) {
+				data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int file = open(path, O_RDONLY);
+		if (file == -1) {
+			throw std::runtime_error("Cannot open file " + std::string(path));
+		}
+		struct stat info;
+		fstat(file, &info);
+		size_ = static_cast<size_t>(info.st_size);
+		if (size_ > 0) {
+			void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+			data_ = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+		}
+		close(file);
+#endif
+		if (size_ > 0 && data_ == nullptr) {
+			throw std::runtime_error("Cannot map file " + std::string(path));
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (data_ != nullptr) {
+#ifdef _WIN32
+			UnmapViewOfFile(data_);
+#else
+			munmap(const_cast<char*>(data_), size_);
+#endif
+		}
+	}
+
+	const char* GetData() const {
+		return data_;
+	}
+
+	size_t GetSize() const {
+		return size_;
+	}
+
+private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+// Index file of a StaticRTree, in native byte order: IndexHeader, the coordinates of all levels from the leaves up
+// in the layout of the tree, and the ids of the leaves. The arrays are 64-byte aligned, so the mapped file is
+// queried in place. The layout of the levels follows from the number of entries and is not stored.
+struct IndexHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t fanout;
+	uint64_t num_of_entries;
+	uint64_t coordinates_offset;
+	uint64_t ids_offset;
+};
+
+// "RTREEIDX".
+constexpr uint64_t INDEX_MAGIC{ 0x5844494545525452ULL };
+// Version 1 padded the levels with inverted infinite boxes, which a query of infinite extent intersects.
+constexpr uint32_t INDEX_VERSION{ 2 };
+
+inline uint64_t AlignIndexOffset(uint64_t offset) {
+	return (offset + 63) / 64 * 64;
+}
+
+// Read-only R-tree packed into flat arrays. The entries are sorted by their centers along the Hilbert curve and
+// cut into leaves of RTREE_FANOUT entries; the boxes of the leaves are cut the same way into the nodes of the next
+// level, and so on up to a single root block. A level is stored as four arrays (min x, min y, max x, max y) of
+// RTREE_FANOUT-sized blocks, so the children of a node lie next to each other in every array and are tested
+// against the query with a few vector compares instead of a pointer chase per child.
+class StaticRTree {
+public:
+	StaticRTree(const std::vector<Box>& boxes, const std::vector<int>& ids)
+		: size_(boxes.size()), levels_(LayOutLevels(boxes.size())) {
+		if (boxes.empty()) {
+			return;
+		}
+		// The last block of a level is padded with NaN boxes: every compare with NaN is false, so they intersect
+		// no query, even one of infinite extent.
+		coordinates_.resize(GetNumOfCoordinates(), std::numeric_limits<double>::quiet_NaN());
+		std::vector<size_t> order = SortAlongHilbertCurve(boxes);
+		ids_.resize(levels_[0].size, 0);
+		for (size_t i = 0; i < order.size(); ++i) {
+			SetBox(levels_[0], i, boxes[order[i]]);
+			ids_[i] = ids[order[i]];
+		}
+		for (size_t i = 1; i < levels_.size(); ++i) {
+			const Level& children = levels_[i - 1];
+			const Level& parents = levels_[i];
+			for (size_t block = 0; block < children.size / RTREE_FANOUT; ++block) {
+				// std::min and std::max keep their first argument when the second is NaN, so the padding boxes
+				// do not change the union.
+				Box box = EmptyBox();
+				for (size_t entry = block * RTREE_FANOUT; entry < (block + 1) * RTREE_FANOUT; ++entry) {
+					box.min_x = std::min(box.min_x, MinX(children)[entry]);
+					box.min_y = std::min(box.min_y, MinY(children)[entry]);
+					box.max_x = std::max(box.max_x, MaxX(children)[entry]);
+					box.max_y = std::max(box.max_y, MaxY(children)[entry]);
+				}
+				SetBox(parents, block, box);
+			}
+		}
+		coordinates_data_ = coordinates_.data();
+		ids_data_ = ids_.data();
+	}
+
+	// Opens an index file written by Save. The tree reads the mapped file as it is.
+	explicit StaticRTree(const std::string& path) : file_(new MappedFile(path.c_str())) {
+		const auto* header = reinterpret_cast<const IndexHeader*>(file_->GetData());
+		if (file_->GetSize() < sizeof(IndexHeader) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION
+			|| header->fanout != RTREE_FANOUT) {
+			throw std::runtime_error("Not an index file: " + path);
+		}
+		if (header->num_of_entries > file_->GetSize() / sizeof(int)) {
+			throw std::runtime_error("Index file is truncated: " + path);
+		}
+		size_ = static_cast<size_t>(header->num_of_entries);
+		levels_ = LayOutLevels(size_);
+		if (header->coordinates_offset % 64 != 0 || header->ids_offset % 64 != 0
+			|| header->coordinates_offset < sizeof(IndexHeader)
+			|| header->ids_offset < header->coordinates_offset + GetNumOfCoordinates() * sizeof(double)
+			|| file_->GetSize() < header->ids_offset + GetNumOfIds() * sizeof(int)) {
+			throw std::runtime_error("Index file is truncated: " + path);
+		}
+		coordinates_data_ = reinterpret_cast<const double*>(file_->GetData() + header->coordinates_offset);
+		ids_data_ = reinterpret_cast<const int*>(file_->GetData() + header->ids_offset);
+	}
+
+	// Writes the tree to an index file.
+	void Save(const std::string& path) const {
+		IndexHeader header{ INDEX_MAGIC, INDEX_VERSION, RTREE_FANOUT, size_, 0, 0 };
+		header.coordinates_offset = AlignIndexOffset(sizeof(IndexHeader));
+		header.ids_offset = AlignIndexOffset(header.coordinates_offset + GetNumOfCoordinates() * sizeof(double));
+
+		std::ofstream output(path, std::ios::binary | std::ios::trunc);
+		if (!output.is_open()) {
+			throw std::runtime_error("Cannot open file " + path);
+		}
+		const char padding[64] = {};
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		output.write(padding, static_cast<std::streamsize>(header.coordinates_offset - sizeof(header)));
+		output.write(reinterpret_cast<const char*>(coordinates_data_),
+			static_cast<std::streamsize>(GetNumOfCoordinates() * sizeof(double)));
+		output.write(padding, static_cast<std::streamsize>(
+			header.ids_offset - header.coordinates_offset - GetNumOfCoordinates() * sizeof(double)));
+		output.write(reinterpret_cast<const char*>(ids_data_), static_cast<std::streamsize>(GetNumOfIds() * sizeof(int)));
+		if (!output) {
+			throw std::runtime_error("Cannot write file " + path);
+		}
+	}
+
+	// Number of entries.
+	size_t Size() const {
+		return size_;
+	}
+
+	// Calls output with the id of every entry whose box intersects the query, in no particular order.
+	template <typename Output>
+	void Query(const Box& query, Output output) const {
+		if (levels_.empty()) {
+			return;
+		}
+		// Blocks left to test. Every tested block adds at most RTREE_FANOUT blocks of the level below, so the stack
+		// never holds more than RTREE_FANOUT blocks per level.
+		BlockRef stack[RTREE_FANOUT * MAX_LEVELS];
+		size_t stack_size = 0;
+		stack[stack_size++] = { levels_.size() - 1, 0 };
+		while (stack_size != 0) {
+			BlockRef block = stack[--stack_size];
+			unsigned hits = FindIntersecting(levels_[block.level], block.index, query);
+			while (hits != 0) {
+				size_t entry = block.index * RTREE_FANOUT + CountTrailingZeros(hits);
+				hits &= hits - 1;
+				if (block.level == 0) {
+					output(ids_data_[entry]);
+				}
+				else {
+					stack[stack_size++] = { block.level - 1, entry };
+				}
+			}
+		}
+	}
+
+private:
+	// Every level has at most a RTREE_FANOUT-th of the boxes of the level below.
+	static constexpr size_t MAX_LEVELS{ (sizeof(size_t) * 8 + 2) / 3 };
+
+	// Place of a level in coordinates_: its four arrays of size boxes each start at offset.
+	struct Level {
+		size_t offset;
+		size_t size;
+	};
+
+	struct BlockRef {
+		size_t level;
+		size_t index;
+	};
+
+	static_assert(sizeof(int) == sizeof(int32_t), "Ids are stored in index files as 32-bit numbers");
+
+	size_t size_;
+	// The levels from the leaves up to the root.
+	std::vector<Level> levels_;
+	// Storage of a tree built in memory. A tree opened from an index file reads the mapped file instead.
+	std::vector<double> coordinates_;
+	std::vector<int> ids_;
+	std::unique_ptr<MappedFile> file_;
+	const double* coordinates_data_ = nullptr;
+	// Ids of the entries in the order of the leaves.
+	const int* ids_data_ = nullptr;
+
+	static size_t RoundUp(size_t size) {
+		return (size + RTREE_FANOUT - 1) / RTREE_FANOUT * RTREE_FANOUT;
+	}
+
+	// Box that every box widens.
+	static Box EmptyBox() {
+		const double infinity = std::numeric_limits<double>::infinity();
+		return { infinity, infinity, -infinity, -infinity };
+	}
+
+	static std::vector<size_t> SortAlongHilbertCurve(const std::vector<Box>& boxes) {
+		Box extent = EmptyBox();
+		for (const Box& box : boxes) {
+			extent.min_x = std::min(extent.min_x, (box.min_x + box.max_x) / 2);
+			extent.min_y = std::min(extent.min_y, (box.min_y + box.max_y) / 2);
+			extent.max_x = std::max(extent.max_x, (box.min_x + box.max_x) / 2);
+			extent.max_y = std::max(extent.max_y, (box.min_y + box.max_y) / 2);
+		}
+		const double cells = (1 << 16) - 1;
+		double scale_x = extent.max_x > extent.min_x ? cells / (extent.max_x - extent.min_x) : 0;
+		double scale_y = extent.max_y > extent.min_y ? cells / (extent.max_y - extent.min_y) : 0;
+		std::vector<std::pair<uint32_t, size_t>> keys(boxes.size());
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			double x = ((boxes[i].min_x + boxes[i].max_x) / 2 - extent.min_x) * scale_x;
+			double y = ((boxes[i].min_y + boxes[i].max_y) / 2 - extent.min_y) * scale_y;
+			keys[i] = { HilbertIndex(static_cast<uint32_t>(x), static_cast<uint32_t>(y)), i };
+		}
+		std::sort(keys.begin(), keys.end());
+		std::vector<size_t> order(boxes.size());
+		for (size_t i = 0; i < keys.size(); ++i) {
+			order[i] = keys[i].second;
+		}
+		return order;
+	}
+
+	// Places the levels of a tree of num_of_entries entries one after another.
+	static std::vector<Level> LayOutLevels(size_t num_of_entries) {
+		std::vector<Level> levels;
+		if (num_of_entries == 0) {
+			return levels;
+		}
+		levels.push_back({ 0, RoundUp(num_of_entries) });
+		while (levels.back().size > RTREE_FANOUT) {
+			levels.push_back({ levels.back().offset + 4 * levels.back().size, RoundUp(levels.back().size / RTREE_FANOUT) });
+		}
+		return levels;
+	}
+
+	size_t GetNumOfCoordinates() const {
+		return levels_.empty() ? 0 : levels_.back().offset + 4 * levels_.back().size;
+	}
+
+	size_t GetNumOfIds() const {
+		return levels_.empty() ? 0 : levels_[0].size;
+	}
+
+	double* MinX(const Level& level) {
+		return coordinates_.data() + level.offset;
+	}
+	double* MinY(const Level& level) {
+		return MinX(level) + level.size;
+	}
+	double* MaxX(const Level& level) {
+		return MinX(level) + 2 * level.size;
+	}
+	double* MaxY(const Level& level) {
+		return MinX(level) + 3 * level.size;
+	}
+
+	void SetBox(const Level& level, size_t index, const Box& box) {
+		MinX(level)[index] = box.min_x;
+		MinY(level)[index] = box.min_y;
+		MaxX(level)[index] = box.max_x;
+		MaxY(level)[index] = box.max_y;
+	}
+
+	// Mask of the boxes of the block that intersect the query.
+	unsigned FindIntersecting(const Level& level, size_t block, const Box& query) const {
+		const double* min_x = coordinates_data_ + level.offset + block * RTREE_FANOUT;
+		const double* min_y = min_x + level.size;
+		const double* max_x = min_x + 2 * level.size;
+		const double* max_y = min_x + 3 * level.size;
+		unsigned hits = 0;
+#if defined(__AVX2__)
+		const __m256d query_min_x = _mm256_set1_pd(query.min_x), query_min_y = _mm256_set1_pd(query.min_y);
+		const __m256d query_max_x = _mm256_set1_pd(query.max_x), query_max_y = _mm256_set1_pd(query.max_y);
+		for (size_t i = 0; i < RTREE_FANOUT; i += 4) {
+			__m256d x = _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(min_x + i), query_max_x, _CMP_LE_OQ),
+				_mm256_cmp_pd(_mm256_loadu_pd(max_x + i), query_min_x, _CMP_GE_OQ));
+			__m256d y = _mm256_and_pd(_mm256_cmp_pd(_mm256_loadu_pd(min_y + i), query_max_y, _CMP_LE_OQ),
+				_mm256_cmp_pd(_mm256_loadu_pd(max_y + i), query_min_y, _CMP_GE_OQ));
+			hits |= static_cast<unsigned>(_mm256_movemask_pd(_mm256_and_pd(x, y))) << i;
+		}
+#elif defined(RTREE_HAS_SSE2)
+		const __m128d query_min_x = _mm_set1_pd(query.min_x), query_min_y = _mm_set1_pd(query.min_y);
+		const __m128d query_max_x = _mm_set1_pd(query.max_x), query_max_y = _mm_set1_pd(query.max_y);
+		for (size_t i = 0; i < RTREE_FANOUT; i += 2) {
+			__m128d x = _mm_and_pd(_mm_cmple_pd(_mm_loadu_pd(min_x + i), query_max_x),
+				_mm_cmpge_pd(_mm_loadu_pd(max_x + i), query_min_x));
+			__m128d y = _mm_and_pd(_mm_cmple_pd(_mm_loadu_pd(min_y + i), query_max_y),
+				_mm_cmpge_pd(_mm_loadu_pd(max_y + i), query_min_y));
+			hits |= static_cast<unsigned>(_mm_movemask_pd(_mm_and_pd(x, y))) << i;
+		}
+#else
+		for (size_t i = 0; i < RTREE_FANOUT; ++i) {
+			bool intersects = min_x[i] <= query.max_x && max_x[i] >= query.min_x
+				&& min_y[i] <= query.max_y && max_y[i] >= query.min_y;
+			hits |= (intersects ? 1u : 0u) << i;
+		}
+#endif
+		return hits;
+	}
+};
@@ -1,43 +1,126 @@
 #include <algorithm>
+#include <atomic>
 #include <boost/geometry/geometry.hpp>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <gdal.h>
+#include <mutex>
 #include <ogrsf_frmts.h>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "StaticRTree.h"
 
 using Point = boost::geometry::model::point<double, 2, boost::geometry::cs::cartesian>;
 using Rectangle = boost::geometry::model::box<Point>;
 using Node = std::pair<Rectangle, int>;
-using RTree = boost::geometry::index::rtree<Node, boost::geometry::index::quadratic<8, 4>>;
 
 
 Rectangle ToRectangle(const OGREnvelope& envelope) {
 	return Rectangle({ envelope.MinX, envelope.MinY }, { envelope.MaxX, envelope.MaxY });
 }
 
-// Fills RTree with MBRs of polygons from dataset.
-void FillRTree(GDALDataset* dataset, RTree& rtree) {
+bool TryReadDatasetFromFile(const std::string& file_path, GDALDataset** dataset) {
+	*dataset = static_cast<GDALDataset*>(
+		GDALOpenEx(file_path.c_str(), GDAL_OF_VECTOR,
+			nullptr, nullptr, nullptr));
+	return *dataset != nullptr;
+}
+
+// Appends MBRs and ids of the features of the dataset from the first-th to the last-th one (counting through all
+// layers in order) to nodes. Features without geometry are skipped.
+void ReadNodes(GDALDataset* dataset, GIntBig first, GIntBig last, std::vector<Node>& nodes) {
 	OGREnvelope envelope;
-	for (auto&& layer : dataset->GetLayers()) {
-		for (auto&& feature : layer) {
-			feature->GetGeometryRef()->getEnvelope(&envelope);
-			Rectangle mbr = ToRectangle(envelope);
-			int osm_id = feature->GetFieldAsInteger("OSM_ID");
+	GIntBig layer_begin = 0;
+	for (int i = 0; i < dataset->GetLayerCount() && layer_begin < last; ++i) {
+		OGRLayer* layer = dataset->GetLayer(i);
+		GIntBig layer_end = layer_begin + layer->GetFeatureCount();
+		if (layer_end > first) {
+			GIntBig index = std::max(first, layer_begin);
+			layer->SetNextByIndex(index - layer_begin);
+			for (; index < std::min(last, layer_end); ++index) {
+				OGRFeatureUniquePtr feature(layer->GetNextFeature());
+				if (feature == nullptr) {
+					break;
+				}
+				OGRGeometry* geometry = feature->GetGeometryRef();
+				if (geometry != nullptr) {
+					geometry->getEnvelope(&envelope);
+					nodes.emplace_back(ToRectangle(envelope), feature->GetFieldAsInteger("OSM_ID"));
+				}
+			}
+		}
+		layer_begin = layer_end;
+	}
+}
 
-			rtree.insert(std::make_pair(mbr, osm_id));
+// Returns MBRs of polygons from dataset with their ids, in the order of the features. The features are split into
+// as many ranges as there are threads, and every range is read on its own thread with its own handle of the
+// dataset, as GDAL handles must not be shared between threads.
+std::vector<Node> ReadAllNodes(const std::string& file_path, GDALDataset* dataset) {
+	GIntBig num_of_features = 0;
+	for (int i = 0; i < dataset->GetLayerCount(); ++i) {
+		num_of_features += dataset->GetLayer(i)->GetFeatureCount();
+	}
+	// The first range is read with the given handle.
+	std::vector<GDALDataset*> handles(1, dataset);
+	unsigned num_of_threads = std::max(1u, std::thread::hardware_concurrency());
+	while (handles.size() < num_of_threads && handles.size() < static_cast<size_t>(num_of_features)) {
+		GDALDataset* handle = nullptr;
+		if (!TryReadDatasetFromFile(file_path, &handle)) {
+			break;
 		}
+		handles.push_back(handle);
+	}
+
+	std::vector<std::vector<Node>> ranges(handles.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < handles.size(); ++i) {
+		GIntBig first = num_of_features * i / handles.size(), last = num_of_features * (i + 1) / handles.size();
+		ranges[i].reserve(static_cast<size_t>(last - first));
+		threads.emplace_back(ReadNodes, handles[i], first, last, std::ref(ranges[i]));
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
 	}
+	for (size_t i = 1; i < handles.size(); ++i) {
+		GDALClose(handles[i]);
+	}
+
+	std::vector<Node> nodes;
+	nodes.reserve(static_cast<size_t>(num_of_features));
+	for (const std::vector<Node>& range : ranges) {
+		nodes.insert(nodes.end(), range.begin(), range.end());
+	}
+	return nodes;
+}
+
+Box ToBox(const Rectangle& rectangle) {
+	return { rectangle.min_corner().get<0>(), rectangle.min_corner().get<1>(),
+		rectangle.max_corner().get<0>(), rectangle.max_corner().get<1>() };
+}
+
+// Packs the nodes into a static R-tree.
+StaticRTree BuildRTree(const std::vector<Node>& nodes) {
+	std::vector<Box> boxes;
+	std::vector<int> ids;
+	boxes.reserve(nodes.size());
+	ids.reserve(nodes.size());
+	for (const Node& node : nodes) {
+		boxes.push_back(ToBox(node.first));
+		ids.push_back(node.second);
+	}
+	return StaticRTree(boxes, ids);
 }
 
 // Returns ids of all objects in rtree which are intersected by requested_rectangle.
-std::vector<int> GetAllIntersectionsIds(const RTree& rtree, const Rectangle& requested_rectangle) {
-	std::vector<Node> intersection_nodes;
-	rtree.query(boost::geometry::index::intersects(requested_rectangle), std::back_inserter(intersection_nodes));
+std::vector<int> GetAllIntersectionsIds(const StaticRTree& rtree, const Rectangle& requested_rectangle) {
 	std::vector<int> intersection_ids;
-	for (auto& node : intersection_nodes) {
-		intersection_ids.push_back(node.second);
-	}
+	rtree.Query(ToBox(requested_rectangle), [&intersection_ids](int id) { intersection_ids.push_back(id); });
 	return intersection_ids;
 }
 
@@ -50,11 +133,74 @@ Rectangle ReadRectangleFromFile(const std::string& path) {
 	return Rectangle({ min_x, min_y }, { max_x, max_y });
 }
 
-bool TryReadDatasetFromFile(const std::string& file_path, GDALDataset** dataset) {
-	*dataset = static_cast<GDALDataset*>(
-		GDALOpenEx(file_path.c_str(), GDAL_OF_VECTOR,
-			nullptr, nullptr, nullptr));
-	return *dataset != nullptr;
+// Reads rectangles from file, one per line in the format of ReadRectangleFromFile.
+std::vector<Rectangle> ReadRectanglesFromFile(const std::string& path) {
+	std::vector<Rectangle> rectangles;
+	double min_x, min_y, max_x, max_y;
+	std::ifstream in(path);
+	while (in >> min_x >> min_y >> max_x >> max_y) {
+		rectangles.push_back(Rectangle({ min_x, min_y }, { max_x, max_y }));
+	}
+	return rectangles;
+}
+
+// Number of queries a thread takes at a time.
+const size_t QUERY_CHUNK_SIZE{ 1024 };
+
+// Answers the queries on all hardware threads and writes the sorted ids of each query, space-separated on a line
+// of its own, in the order of the queries. The threads take chunks of queries in turn and print the answers of a
+// chunk into its own string. The calling thread writes each chunk as soon as it and all the chunks before it are
+// answered, and frees it, so only the chunks answered ahead of the written ones are held in memory.
+void WriteAllIntersectionsIds(const StaticRTree& rtree, const std::vector<Rectangle>& queries, std::ostream& out) {
+	size_t num_of_chunks = (queries.size() + QUERY_CHUNK_SIZE - 1) / QUERY_CHUNK_SIZE;
+	std::vector<std::string> answers(num_of_chunks);
+	// Guarded by the mutex; set when the answers of the chunk are printed.
+	std::vector<bool> is_ready(num_of_chunks, false);
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::atomic<size_t> next_chunk{ 0 };
+	auto answer_chunks = [&]() {
+		std::vector<int> ids;
+		for (size_t chunk = next_chunk++; chunk < num_of_chunks; chunk = next_chunk++) {
+			std::string text;
+			for (size_t i = chunk * QUERY_CHUNK_SIZE; i < std::min(queries.size(), (chunk + 1) * QUERY_CHUNK_SIZE); ++i) {
+				ids.clear();
+				rtree.Query(ToBox(queries[i]), [&ids](int id) { ids.push_back(id); });
+				std::sort(ids.begin(), ids.end());
+				for (size_t j = 0; j < ids.size(); ++j) {
+					if (j != 0) {
+						text += ' ';
+					}
+					text += std::to_string(ids[j]);
+				}
+				text += '\n';
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				answers[chunk] = std::move(text);
+				is_ready[chunk] = true;
+			}
+			ready.notify_one();
+		}
+	};
+
+	size_t num_of_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), num_of_chunks);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < num_of_threads; ++i) {
+		threads.emplace_back(answer_chunks);
+	}
+	for (size_t chunk = 0; chunk < num_of_chunks; ++chunk) {
+		std::string text;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			ready.wait(lock, [&] { return is_ready[chunk]; });
+			text.swap(answers[chunk]);
+		}
+		out.write(text.data(), static_cast<std::streamsize>(text.size()));
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
 }
 
 void WriteToFile(const std::string& path, const std::vector<int>& vector) {
@@ -65,30 +211,74 @@ void WriteToFile(const std::string& path, const std::vector<int>& vector) {
 	out.close();
 }
 
-int main(int argc, char** argv) {
-	if (argc != 4) {
-		std::cerr << "You must specify path to data, path to input file and path to output file in command line arguments!";
-		return -1;
-	}
-	std::string data_path = argv[1], input_file_path = argv[2], output_file_path = argv[3];
+// Reads the dataset of the data directory and packs it into an R-tree.
+StaticRTree ReadRTreeFromDataset(const std::string& data_path) {
 	std::string shape_file_path = data_path + "/building-polygon.shp";
 
 	GDALAllRegister();
 	//Reading the dataset from file.
 	GDALDataset* dataset = nullptr;
 	if (!TryReadDatasetFromFile(shape_file_path, &dataset)) {
-		std::cerr << "Cannot open file!" << std::endl;
-		return -1;
+		throw std::runtime_error("Cannot open file!");
 	}
-	//Filling the RTree with dataset objects.
-	RTree rtree;
-	FillRTree(dataset, rtree);
-	// Reading the rectangle.
-	Rectangle requested_rectangle = ReadRectangleFromFile(input_file_path);
-	// Constructing result
-	std::vector<int> insersections = GetAllIntersectionsIds(rtree, requested_rectangle);
-	std::sort(insersections.begin(), insersections.end());
+	//Filling the RTree with dataset objects. The tree is packed from all of them at once, which is faster than
+	// inserting them one by one and gives full nodes that overlap little.
+	return BuildRTree(ReadAllNodes(shape_file_path, dataset));
+}
+
+// "index build <data> <index>" packs the dataset into an index file. Queries are answered from the dataset, or,
+// with -index, from such a file, which is mapped into memory instead of being read. With -batch, the input file
+// holds many rectangles, one per line, and the output file gets the answer to each of them on a line of its own.
+int main(int argc, char** argv) {
+	try {
+		if (argc > 2 && std::string(argv[1]) == "index" && std::string(argv[2]) == "build") {
+			if (argc != 5) {
+				std::cerr << "You must specify path to data and path to index file after \"index build\"!";
+				return -1;
+			}
+			ReadRTreeFromDataset(argv[3]).Save(argv[4]);
+			return 0;
+		}
+
+		bool is_batch = false, is_index = false;
+		int first = 1;
+		for (; first < argc; ++first) {
+			std::string flag = argv[first];
+			if (flag == "-batch") {
+				is_batch = true;
+			}
+			else if (flag == "-index") {
+				is_index = true;
+			}
+			else {
+				break;
+			}
+		}
+		if (argc - first != 3) {
+			std::cerr << "You must specify path to data, path to input file and path to output file in command line"
+				" arguments (after -batch to answer many rectangles at once, after -index to read the index file given"
+				" in place of the data)!";
+			return -1;
+		}
+		std::string data_path = argv[first], input_file_path = argv[first + 1], output_file_path = argv[first + 2];
+
+		StaticRTree rtree = is_index ? StaticRTree(data_path) : ReadRTreeFromDataset(data_path);
+		if (is_batch) {
+			std::ofstream out(output_file_path, std::ios::binary);
+			WriteAllIntersectionsIds(rtree, ReadRectanglesFromFile(input_file_path), out);
+			return 0;
+		}
+		// Reading the rectangle.
+		Rectangle requested_rectangle = ReadRectangleFromFile(input_file_path);
+		// Constructing result
+		std::vector<int> insersections = GetAllIntersectionsIds(rtree, requested_rectangle);
+		std::sort(insersections.begin(), insersections.end());
 
-	WriteToFile(output_file_path, insersections);
+		WriteToFile(output_file_path, insersections);
+	}
+	catch (std::runtime_error& e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
 	return 0;
 }